@@ -0,0 +1,84 @@
+/*
+ *  This example shows how to keep an ISR short by deferring its
+ *  heavy work. The ISR hands a function and argument to 'defer',
+ *  the timer task runs it soon after on the top priority level,
+ *  ahead of any software timer. Here a task stands in for the ISR,
+ *  on a Teensy call 'task.defer(...)' from a DMA or USB interrupt.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define DMA_STACK_SIZE 128
+
+#define BUFFERS     4
+#define BUFFER_SIZE 32
+uint16_t buffers[BUFFERS][BUFFER_SIZE];
+volatile uint32_t processed;
+
+task_timer_t reportTimer;
+
+void setup() {
+    // Add all stack sizes for creating memory pool, deferred work
+    // runs on the timer task's stack
+    const uint32_t MEM_POOL_SIZE =  DMA_STACK_SIZE +
+                                    TIMER_STACK_SIZE;
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(dma, DMA_STACK_SIZE, 0);
+    // creates the timer task, an ISR can't
+    task.deferBegin();
+    task.timerStart(&reportTimer, report, 0, 1000, true);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// the heavy part, runs from the timer task
+static void processBuffer(void *arg) {
+    uint16_t *buffer = (uint16_t *)arg;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < BUFFER_SIZE; i++) sum += buffer[i];
+    processed++;
+}
+/*******************************************************************/
+// stands in for the DMA ISR, a buffer is full every 10ms. Every
+// 3 seconds it floods the queue to show what a full one does.
+static void dma(void *arg) {
+    uint32_t n = 0;
+    while ( 1 ) {
+        task.sleep(10);
+        uint16_t *buffer = buffers[n++ % BUFFERS];
+        for (uint32_t i = 0; i < BUFFER_SIZE; i++) buffer[i] = n + i;
+        task.defer(processBuffer, buffer);
+        if ( n % 300 == 0 ) {
+            for (uint32_t i = 0; i < 2 * DEFER_QUEUE_SIZE; i++) task.defer(processBuffer, buffer);
+        }
+    }
+}
+/*******************************************************************/
+static void report(void *arg) {
+    Serial.print("processed ");
+    Serial.print(processed);
+    Serial.print(" buffers, dropped ");
+    Serial.println(task.deferDropped());
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+}
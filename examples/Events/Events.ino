@@ -0,0 +1,84 @@
+/*
+ *  This example shows how tasks can wait on a semaphore or on
+ *  event flags instead of polling. A waiting task is taken out
+ *  of the context switch until 'give' or 'setFlags' wakes it.
+ *  Both are safe to call from an interrupt, like an IntervalTimer
+ *  or attachInterrupt handler.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define PRODUCER_STACK_SIZE 128
+#define CONSUMER_STACK_SIZE 128
+#define WATCHER_STACK_SIZE  128
+
+// counts samples ready to read
+task_sem_t samplesReady;
+// flag bits for the watcher task
+#define EVENT_TEN_SAMPLES   0x01
+#define EVENT_BUTTON        0x02
+task_event_t events;
+
+void setup() {
+    // Add all stack sizes for creating memory pool
+    const uint32_t MEM_POOL_SIZE =  PRODUCER_STACK_SIZE +
+                                    CONSUMER_STACK_SIZE +
+                                    WATCHER_STACK_SIZE;
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(producer, PRODUCER_STACK_SIZE, 0);
+    task.create(consumer, CONSUMER_STACK_SIZE, 0);
+    task.create(watcher, WATCHER_STACK_SIZE, 0);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// stands in for an ISR, a sample is ready every 250ms
+static void producer(void *arg) {
+    while ( 1 ) {
+        task.sleep(250);
+        task.give(&samplesReady);
+    }
+}
+/*******************************************************************/
+// wakes once per sample, no polling in between
+static void consumer(void *arg) {
+    uint32_t count = 0;
+    while ( 1 ) {
+        task.take(&samplesReady);
+        Serial.print("consumer got sample ");
+        Serial.println(++count);
+        if ( count % 10 == 0 ) task.setFlags(&events, EVENT_TEN_SAMPLES);
+        if ( count % 25 == 0 ) task.setFlags(&events, EVENT_BUTTON);
+    }
+}
+/*******************************************************************/
+// wakes on either flag, waitFlags clears the ones it returns
+static void watcher(void *arg) {
+    while ( 1 ) {
+        uint32_t flags = task.waitFlags(&events, EVENT_TEN_SAMPLES | EVENT_BUTTON);
+        if ( flags & EVENT_TEN_SAMPLES ) Serial.println("watcher: ten more samples");
+        if ( flags & EVENT_BUTTON ) Serial.println("watcher: button");
+        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ *  This example shows how a task waits for others to finish.
+ *  'join' parks the caller until a task returns, it is not switched
+ *  in at all while it waits. A task made with 'createFuture' returns
+ *  a value, which 'futureWait' hands over even after the destroyable
+ *  task and its memory are gone.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define MAIN_STACK_SIZE     128
+#define WORKER_STACK_SIZE   128
+
+task_future_t futures[2];
+
+void setup() {
+    // Add all stack sizes for creating memory pool, the two
+    // destroyable workers come and go inside it
+    const uint32_t MEM_POOL_SIZE =  MAIN_STACK_SIZE +
+                                    2 * WORKER_STACK_SIZE;
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(mainTask, MAIN_STACK_SIZE, 0);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// sums 1..n slowly, the return value goes to its future
+static void *sum(void *arg) {
+    uint32_t n = (uintptr_t)arg;
+    uint32_t total = 0;
+    for (uint32_t i = 1; i <= n; i++) {
+        total += i;
+        task.sleep(10);
+    }
+    return (void *)(uintptr_t)total;
+}
+/*******************************************************************/
+static void mainTask(void *arg) {
+    uint32_t round = 0;
+    while ( 1 ) {
+        round++;
+        // createFuture(function, stack size, argument, future)
+        task_handle_t a = task.createFuture(sum, WORKER_STACK_SIZE, (void *)(uintptr_t)(10 * round), &futures[0]);
+        task_handle_t b = task.createFuture(sum, WORKER_STACK_SIZE, (void *)(uintptr_t)(20 * round), &futures[1]);
+        // wait for the first one to return
+        task.join(a);
+        Serial.print("first sum: ");
+        Serial.println((uintptr_t)task.futureWait(&futures[0]));
+        Serial.print("second is ");
+        Serial.println(task.futureReady(&futures[1]) ? "done too" : "still running");
+        // futureWait parks until its task returns
+        Serial.print("second sum: ");
+        Serial.println((uintptr_t)task.futureWait(&futures[1]));
+        // both are destroyed, their handles are stale now
+        Serial.print("state of b: ");
+        Serial.println(task.state(b) == TaskInvalid ? "TaskInvalid" : "still there");
+        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+        task.sleep(500);
+    }
+}
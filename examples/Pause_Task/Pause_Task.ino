@@ -8,6 +8,8 @@
 
 // zilch os object
 Zilch task;
+// handle returned by 'create', used to control task 2
+task_handle_t task2Handle;
 /*******************************************************************/
 /*
  *  Stack size is calculated in increments of 32 bits.
@@ -29,7 +31,7 @@ void setup() {
     Serial.println("Starting tasks now...");
     // create tasks but do not start 'os' yet
     task.create(task1, TASK1_STACK_SIZE, 0);
-    task.create(task2, TASK2_STACK_SIZE, 0);
+    task2Handle = task.create(task2, TASK2_STACK_SIZE, 0);
     // start os, all tasks start here in order of 'create' functions
     task.begin();
     // should not get here
@@ -52,7 +54,7 @@ static void task1(void *arg) {
         if (task2PauseTimer >= 5000 && !Task2PauseTask) {
             Serial.println("\nTask 1 is Pausing Task 2");
             // pause task 2 for 5000ms
-            task.pause(task2);
+            task.pause(task2Handle);
             Task2PauseTask = true;
             task2ResumeTimer = 0;
         }
@@ -60,7 +62,7 @@ static void task1(void *arg) {
         if (task2ResumeTimer >= 5000 && Task2PauseTask) {
             Serial.println("Task 1 is Resuming Task 2\n");
             // resume task2, will start again where it was paused.
-            task.resume(task2);
+            task.resume(task2Handle);
             Task2PauseTask = false;
             task2PauseTimer = 0;
         }
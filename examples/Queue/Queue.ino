@@ -0,0 +1,119 @@
+/*
+ *  This example shows a sensor -> filter -> logger pipeline built
+ *  from two message queues. Messages are written and read in place
+ *  in the queue's slots, nothing is copied. A task waiting on an
+ *  empty queue, or a full one, is taken out of the context switch.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define SENSOR_STACK_SIZE   128
+#define FILTER_STACK_SIZE   128
+#define LOGGER_STACK_SIZE   128
+
+struct Sample {
+    uint32_t time;
+    int32_t  value;
+};
+
+struct Average {
+    uint32_t time;
+    int32_t  min;
+    int32_t  max;
+    int32_t  mean;
+};
+
+#define SAMPLE_QUEUE_LENGTH  8
+#define AVERAGE_QUEUE_LENGTH 2
+#define SAMPLES_PER_AVERAGE  16
+
+TaskQueue<Sample>  samples;
+TaskQueue<Average> averages;
+
+void setup() {
+    // Add all stack sizes and queue slots for creating memory pool
+    const uint32_t MEM_POOL_SIZE =  SENSOR_STACK_SIZE +
+                                    FILTER_STACK_SIZE +
+                                    LOGGER_STACK_SIZE +
+                                    QUEUE_MEMORY(sizeof(Sample), SAMPLE_QUEUE_LENGTH) +
+                                    QUEUE_MEMORY(sizeof(Average), AVERAGE_QUEUE_LENGTH);
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    // queue slots come out of the memory pool too
+    samples.begin(SAMPLE_QUEUE_LENGTH);
+    averages.begin(AVERAGE_QUEUE_LENGTH);
+    task.create(sensor, SENSOR_STACK_SIZE, 0);
+    task.create(filter, FILTER_STACK_SIZE, 0);
+    task.create(logger, LOGGER_STACK_SIZE, 0);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// fills a reserved slot in place, waits if the filter falls behind
+static void sensor(void *arg) {
+    int32_t value = 0;
+    while ( 1 ) {
+        Sample *s = samples.reserve();
+        s->time  = millis();
+        s->value = value;
+        samples.commit(s);
+        value = (value + 37) % 1000;
+        task.sleep(10);
+    }
+}
+/*******************************************************************/
+// reads samples in place, sends one average per 16 samples
+static void filter(void *arg) {
+    while ( 1 ) {
+        Average *a = averages.reserve();
+        int32_t sum = 0;
+        a->min = INT32_MAX;
+        a->max = INT32_MIN;
+        for (int i = 0; i < SAMPLES_PER_AVERAGE; i++) {
+            Sample *s = samples.receive();
+            if (s->value < a->min) a->min = s->value;
+            if (s->value > a->max) a->max = s->value;
+            sum += s->value;
+            a->time = s->time;
+            samples.release(s);
+        }
+        a->mean = sum / SAMPLES_PER_AVERAGE;
+        averages.commit(a);
+    }
+}
+/*******************************************************************/
+// copying receive is fine for small messages
+static void logger(void *arg) {
+    while ( 1 ) {
+        Average a;
+        averages.receive(a);
+        Serial.print(a.time);
+        Serial.print(" ms  min: ");
+        Serial.print(a.min);
+        Serial.print("  max: ");
+        Serial.print(a.max);
+        Serial.print("  mean: ");
+        Serial.println(a.mean);
+        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ *  This example shows how to stream samples from an interrupt to
+ *  a task with a TaskRing. The writing side never blocks so it is
+ *  safe in an ISR, the reading task waits out of the context switch
+ *  until a whole block of samples is pending and reads them in one
+ *  go. Here a task stands in for the ISR, on a Teensy call
+ *  'adc.write(sample)' from an IntervalTimer or ADC interrupt.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define SAMPLER_STACK_SIZE  128
+#define PROCESS_STACK_SIZE  128
+
+// ring size must be a power of two
+#define RING_SIZE   256
+#define BLOCK_SIZE  64
+
+TaskRing<uint16_t, RING_SIZE> adc;
+
+void setup() {
+    // Add all stack sizes for creating memory pool
+    const uint32_t MEM_POOL_SIZE = SAMPLER_STACK_SIZE + PROCESS_STACK_SIZE;
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(sampler, SAMPLER_STACK_SIZE, 0);
+    task.create(process, PROCESS_STACK_SIZE, 0);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// stands in for the ADC ISR, one sample every 100us
+static void sampler(void *arg) {
+    uint16_t sample = 0;
+    uint32_t dropped = 0;
+    while ( 1 ) {
+        if (!adc.write(sample++)) dropped++;
+        task.sleepMicroseconds(100);
+    }
+}
+/*******************************************************************/
+// wakes once per block instead of once per sample
+static void process(void *arg) {
+    uint16_t block[BLOCK_SIZE];
+    uint32_t blocks = 0;
+    while ( 1 ) {
+        adc.wait(BLOCK_SIZE);
+        uint32_t n = adc.read(block, BLOCK_SIZE);
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < n; i++) sum += block[i];
+        if (++blocks % 16 == 0) {
+            Serial.print("block ");
+            Serial.print(blocks);
+            Serial.print(" first: ");
+            Serial.print(block[0]);
+            Serial.print(" mean: ");
+            Serial.println(sum / n);
+            digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+        }
+    }
+}
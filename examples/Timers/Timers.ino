@@ -0,0 +1,84 @@
+/*
+ *  This example shows software timers. Every callback runs from
+ *  one shared timer task, so periodic jobs don't each need a task
+ *  and stack of their own. Callbacks should be short and must not
+ *  sleep or wait, the other timers are held up till they return.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define MAIN_STACK_SIZE 128
+
+// zero initialized, the timer calls fill them in
+task_timer_t blinkTimer;
+task_timer_t countTimer;
+task_timer_t onceTimer;
+
+volatile uint32_t counts;
+
+void setup() {
+    // Add all stack sizes for creating memory pool, the timer
+    // task is created by the first timerStart
+    const uint32_t MEM_POOL_SIZE =  MAIN_STACK_SIZE +
+                                    TIMER_STACK_SIZE;
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(mainTask, MAIN_STACK_SIZE, 0);
+    // timerStart(timer, function, argument, period ms, reload)
+    task.timerStart(&blinkTimer, blink, 0, 250, true);
+    task.timerStart(&countTimer, count, 0, 10, true);
+    task.timerStart(&onceTimer, once, (void *)"one shot after 1s", 1000);
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+static void blink(void *arg) {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+}
+/*******************************************************************/
+static void count(void *arg) {
+    counts++;
+}
+/*******************************************************************/
+static void once(void *arg) {
+    Serial.println((const char *)arg);
+}
+/*******************************************************************/
+// prints the count every second, after 3 seconds blinks faster
+static void mainTask(void *arg) {
+    uint32_t seconds = 0;
+    while ( 1 ) {
+        task.sleep(1000);
+        Serial.print("10ms timer ran ");
+        Serial.print(counts);
+        Serial.println(" times");
+        if ( ++seconds == 3 ) {
+            Serial.println("blink every 100ms now");
+            task.timerPeriod(&blinkTimer, 100);
+        }
+        if ( seconds == 6 ) {
+            Serial.println("count timer stopped");
+            task.timerStop(&countTimer);
+        }
+    }
+}
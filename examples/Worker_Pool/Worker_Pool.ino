@@ -0,0 +1,102 @@
+/*
+ *  This example shows a worker pool. A few worker tasks are made
+ *  once and run short jobs handed to them through a shared queue,
+ *  instead of creating and destroying a task for every job. Here
+ *  the main task checksums a batch of packets on three workers and
+ *  waits for all of them to finish.
+ */
+#include <zilch.h>
+
+// zilch os object
+Zilch task;
+/*******************************************************************/
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define MAIN_STACK_SIZE     128
+#define WORKER_STACK_SIZE   96
+#define WORKERS             3
+#define QUEUE_CAPACITY      8
+
+#define PACKETS     16
+#define PACKET_SIZE 64
+
+struct packet_t {
+    uint8_t  data[PACKET_SIZE];
+    uint16_t checksum;
+};
+
+packet_t packets[PACKETS];
+void *jobArgs[PACKETS];
+
+task_pool_t pool;
+task_sem_t firstDone;
+
+void setup() {
+    // Add all stack sizes for creating memory pool, POOL_MEMORY
+    // covers the workers' stacks and the job queue
+    const uint32_t MEM_POOL_SIZE =  MAIN_STACK_SIZE +
+                                    POOL_MEMORY(WORKERS, WORKER_STACK_SIZE, QUEUE_CAPACITY);
+    
+    // Allocate memory to the memory pool
+    AllocateMemoryPool(MEM_POOL_SIZE);
+    
+    pinMode(LED_BUILTIN , OUTPUT);
+    while (!Serial);
+    delay(100);
+    Serial.println("Starting tasks now...");
+    task.create(mainTask, MAIN_STACK_SIZE, 0);
+    // poolBegin(pool, workers, worker stack size, queue capacity)
+    if (!task.poolBegin(&pool, WORKERS, WORKER_STACK_SIZE, QUEUE_CAPACITY)) {
+        Serial.println("not enough memory for the pool");
+    }
+    // start os, all tasks start here in order of 'create' functions
+    task.begin();
+    // should not get here
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// one job, Fletcher-16 over a packet
+static void checksum(void *arg) {
+    packet_t *packet = (packet_t *)arg;
+    uint16_t a = 0, b = 0;
+    for (uint32_t i = 0; i < PACKET_SIZE; i++) {
+        a = (a + packet->data[i]) % 255;
+        b = (b + a) % 255;
+    }
+    packet->checksum = (b << 8) | a;
+}
+/*******************************************************************/
+static void mainTask(void *arg) {
+    uint32_t round = 0;
+    for (uint32_t i = 0; i < PACKETS; i++) jobArgs[i] = &packets[i];
+    while ( 1 ) {
+        task.sleep(1000);
+        round++;
+        for (uint32_t i = 0; i < PACKETS; i++) {
+            for (uint32_t j = 0; j < PACKET_SIZE; j++) packets[i].data[j] = round + i + j;
+        }
+        // one job on its own, its semaphore is given when it is done
+        task.submit(&pool, checksum, &packets[0], &firstDone);
+        task.take(&firstDone);
+        Serial.print("round ");
+        Serial.print(round);
+        Serial.print(" packet 0: ");
+        Serial.print(packets[0].checksum, HEX);
+        // the rest in one batch, waiting for all of them
+        task.submitBatch(&pool, checksum, &jobArgs[1], PACKETS - 1);
+        task.poolWait(&pool);
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < PACKETS; i++) sum += packets[i].checksum;
+        Serial.print(" all: ");
+        Serial.println(sum, HEX);
+        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    }
+}
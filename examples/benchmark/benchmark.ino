@@ -0,0 +1,378 @@
+/*
+ *  Benchmarks the scheduler and the memory manager.
+ *
+ *  Results are printed as CSV so runs can be diffed between releases:
+ *
+ *      name,param,iterations,cycles,ns
+ *
+ *  'cycles' and 'ns' are per operation. On Teensy 3.x cycles come
+ *  from the DWT cycle counter, the LC has none so they are derived
+ *  from micros(). The host build (extras/host) uses the TSC and
+ *  exits when done:
+ *
+ *      make -C extras/host run-benchmark > bench.csv
+ */
+#include <zilch.h>
+
+Zilch task;
+
+/*
+ *  Stack size is calculated in increments of 32 bits.
+ *  So a stack size of 128 equals 512 bytes of space.
+ */
+#define CONTROL_STACK_SIZE  256
+#define SPIN_STACK_SIZE     64
+// kernal and control task are always in the ring
+#define RING_OVERHEAD       2
+// every task stack is one memory manager block
+#define MAX_SPIN_TASKS      ( MEM_MAX_BLOCKS - RING_OVERHEAD )
+
+#define YIELD_LAPS          2000
+#define PAUSE_ITERATIONS    500
+#define ALLOC_REPEAT        64
+#define ALLOC_POOL_SIZE     2048
+#define ALLOC_BLOCK_SIZE    32
+#define ALLOC_BIG_SIZE      1024
+/*******************************************************************/
+#if defined(ZILCH_HOST)
+static uint32_t cpu_hz;
+static inline uint32_t cycles( void ) {
+    return __builtin_ia32_rdtsc( );
+}
+static void cycles_begin( void ) {
+    uint32_t us = micros( );
+    uint32_t start = cycles( );
+    while ( micros( ) - us < 100000 ) ;
+    cpu_hz = ( cycles( ) - start ) * 10;
+}
+#elif defined(KINETISK)
+static const uint32_t cpu_hz = F_CPU;
+static inline uint32_t cycles( void ) {
+    return ARM_DWT_CYCCNT;
+}
+static void cycles_begin( void ) {
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+#else
+static const uint32_t cpu_hz = F_CPU;
+static inline uint32_t cycles( void ) {
+    return micros( ) * ( F_CPU / 1000000 );
+}
+static void cycles_begin( void ) {
+
+}
+#endif
+/*******************************************************************/
+// spinners nap instead of yielding while sleep_us is set, or take
+// turns holding a lock across a yield while contend is set
+#define CONTEND_MUTEX       1
+#define CONTEND_SPIN_LOCK   2
+#define CONTEND_SEMAPHORE   3
+static volatile uint32_t sleep_us;
+static volatile int contend;
+static task_mutex_t bench_mutex;
+static volatile unsigned int bench_lock;
+static task_sem_t ping, pong;
+static volatile uint32_t acquisitions, wait_max;
+
+static void hold(uint32_t start) {
+    uint32_t wait = cycles() - start;
+    if (wait > wait_max) wait_max = wait;
+    acquisitions++;
+    yield();
+}
+
+static void spin(void *arg) {
+    while (1) {
+        if (sleep_us) task.sleepMicroseconds(sleep_us);
+        else if (contend) {
+            uint32_t start = cycles();
+            if (contend == CONTEND_SEMAPHORE) {
+                task.take(&ping);
+                task.give(&pong);
+            }
+            else if (contend == CONTEND_MUTEX) TASK_LOCK(bench_mutex) hold(start);
+            else TASK_LOCK(bench_lock) hold(start);
+        }
+        else yield();
+    }
+}
+
+static task_handle_t spinners[MAX_SPIN_TASKS];
+static int num_spinners;
+/*******************************************************************/
+void report(const char *name, uint32_t param, uint32_t iterations, uint32_t total) {
+    double per_op = ( double )total / iterations;
+    Serial.print(name);
+    Serial.print(",");
+    Serial.print(param);
+    Serial.print(",");
+    Serial.print(iterations);
+    Serial.print(",");
+    Serial.print(per_op, 1);
+    Serial.print(",");
+    Serial.println(per_op * 1e9 / cpu_hz, 1);
+}
+/*******************************************************************/
+void setup() {
+    while (!Serial);
+    delay(100);
+    cycles_begin();
+    Serial.println("name,param,iterations,cycles,ns");
+
+    // allocator runs on its own pool, before the tasks get theirs
+    AllocateMemoryPool(ALLOC_POOL_SIZE);
+    bench_allocator();
+    bench_queue();
+    bench_ring();
+
+    const uint32_t MEM_POOL_SIZE = CONTROL_STACK_SIZE + SPIN_STACK_SIZE * MAX_SPIN_TASKS;
+    AllocateMemoryPool(MEM_POOL_SIZE);
+
+    task.create(control, CONTROL_STACK_SIZE, 0);
+    uint32_t total = 0;
+    for (num_spinners = 0; num_spinners < MAX_SPIN_TASKS; num_spinners++) {
+        uint32_t start = cycles();
+        task_handle_t handle = task.create(spin, SPIN_STACK_SIZE, 0);
+        uint32_t stop = cycles();
+        if (task.state(handle) == TaskInvalid) break;
+        spinners[num_spinners] = handle;
+        total += stop - start;
+    }
+    report("create", num_spinners + RING_OVERHEAD, num_spinners, total);
+
+    // nothing is running yet so restarting everything is harmless
+    total = 0;
+    for (int i = 0; i < 16; i++) {
+        uint32_t start = cycles();
+        task.restartAll();
+        total += cycles() - start;
+    }
+    report("restart_all", num_spinners + RING_OVERHEAD, 16, total);
+
+    task.begin();
+}
+/*******************************************************************/
+//  Not used, if here error with Zilch
+void loop() {
+    digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+    Serial.println("ERROR");
+    delay(25);
+}
+/*******************************************************************/
+// alloc and free cost vs. number of free fragments, free merges with
+// its free neighbours as it goes
+void bench_allocator() {
+    mem_manager mem;
+    const int levels[] = { 0, 1, 2, 4, 8, 14 };
+    for (unsigned int l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        int fragments = levels[l];
+        uint32_t small_fit = 0, large_fit = 0, freed = 0, merged = 0;
+        for (int r = 0; r < ALLOC_REPEAT; r++) {
+            mem_manager::init(mem_manager::pool, mem.poolSize());
+            mem_block_t *blocks[32];
+            // every other block freed leaves 'fragments' holes
+            for (int i = 0; i < fragments * 2; i++) {
+                blocks[i] = mem.alloc(ALLOC_BLOCK_SIZE, 0);
+            }
+            for (int i = 0; i < fragments * 2; i += 2) {
+                mem.free(blocks[i]->block);
+            }
+            uint32_t start = cycles();
+            mem_block_t *small = mem.alloc(ALLOC_BLOCK_SIZE / 4, 0);
+            small_fit += cycles() - start;
+
+            start = cycles();
+            mem_block_t *large = mem.alloc(ALLOC_BLOCK_SIZE * 2, 0);
+            large_fit += cycles() - start;
+
+            start = cycles();
+            mem.free(large->block);
+            mem.free(small->block);
+            freed += cycles() - start;
+
+            // a block with a free hole on either side
+            if (fragments >= 2) {
+                start = cycles();
+                mem.free(blocks[1]->block);
+                merged += cycles() - start;
+            }
+        }
+        report("alloc_small", fragments, ALLOC_REPEAT, small_fit);
+        report("alloc_large", fragments, ALLOC_REPEAT, large_fit);
+        report("free", fragments, ALLOC_REPEAT * 2, freed);
+        if (fragments >= 2) report("free_merge_both", fragments, ALLOC_REPEAT, merged);
+    }
+
+    // a big stack with and without the watermark fill
+    uint32_t filled = 0, unfilled = 0;
+    for (int r = 0; r < ALLOC_REPEAT; r++) {
+        mem_manager::init(mem_manager::pool, mem.poolSize());
+        uint32_t start = cycles();
+        mem_block_t *block = mem.alloc(ALLOC_BIG_SIZE, 0xCDCDCDCD);
+        filled += cycles() - start;
+        mem.free(block->block);
+        start = cycles();
+        block = mem.alloc(ALLOC_BIG_SIZE);
+        unfilled += cycles() - start;
+        mem.free(block->block);
+    }
+    report("alloc_filled", ALLOC_BIG_SIZE, ALLOC_REPEAT, filled);
+    report("alloc_unfilled", ALLOC_BIG_SIZE, ALLOC_REPEAT, unfilled);
+
+    // mixed size alloc/free churn, then how much free memory is usable
+    mem_manager::init(mem_manager::pool, mem.poolSize());
+    mem_block_t *live[16] = { 0 };
+    uint32_t seed = 1, churn = 0;
+    for (int i = 0; i < ALLOC_REPEAT * 16; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 16) % 16;
+        uint32_t start = cycles();
+        if (live[slot]) {
+            mem.free(live[slot]->block);
+            live[slot] = NULL;
+        } else {
+            live[slot] = mem.alloc(8 + (seed >> 8) % 56, 0);
+        }
+        churn += cycles() - start;
+    }
+    report("alloc_free_churn", 16, ALLOC_REPEAT * 16, churn);
+    Serial.print("# churn largest free block ");
+    Serial.print(mem.largestFree());
+    Serial.print(" of ");
+    Serial.print(mem.freeWords());
+    Serial.println(" words");
+}
+/*******************************************************************/
+// zero copy queue round trip, nothing waits since no task is running
+void bench_queue() {
+    mem_manager::init(mem_manager::pool, mem_manager().poolSize());
+    TaskQueue<uint32_t> queue;
+    queue.begin(16);
+    uint32_t start = cycles();
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        uint32_t *slot = queue.reserve();
+        *slot = i;
+        queue.commit(slot);
+        slot = queue.receive();
+        queue.release(slot);
+    }
+    report("queue_send_receive", 16, PAUSE_ITERATIONS, cycles() - start);
+    queue.end();
+}
+/*******************************************************************/
+// ring buffer one item at a time vs. batched
+static TaskRing<uint32_t, 64> ring;
+
+void bench_ring() {
+    uint32_t batch[16];
+    uint32_t start = cycles();
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        ring.write(i);
+        ring.read(batch[0]);
+    }
+    report("ring_write_read", 1, PAUSE_ITERATIONS, cycles() - start);
+
+    start = cycles();
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        ring.write(batch, 16);
+        ring.read(batch, 16);
+    }
+    report("ring_write_read", 16, PAUSE_ITERATIONS * 16, cycles() - start);
+}
+/*******************************************************************/
+// yield round trip with 2..MEM_MAX_BLOCKS tasks in the ring
+static void control(void *arg) {
+    for (int i = 0; i < num_spinners; i++) task.pause(spinners[i]);
+
+    int running = 0;
+    for (int ring = 2; ring <= MEM_MAX_BLOCKS; ring *= 2) {
+        if (ring - RING_OVERHEAD > num_spinners) break;
+        while (running < ring - RING_OVERHEAD) task.resume(spinners[running++]);
+        for (int i = 0; i < 100; i++) yield();
+
+        uint32_t start = cycles();
+        for (int i = 0; i < YIELD_LAPS; i++) yield();
+        uint32_t total = cycles() - start;
+        report("yield_lap", ring, YIELD_LAPS, total);
+        report("yield_switch", ring, YIELD_LAPS * ring, total);
+    }
+
+    // pause/resume of one task with every spinner in the ring
+    while (running < num_spinners) task.resume(spinners[running++]);
+    uint32_t pause = 0, resume = 0, restart = 0;
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        uint32_t start = cycles();
+        task.pause(spinners[0]);
+        pause += cycles() - start;
+
+        start = cycles();
+        task.resume(spinners[0]);
+        resume += cycles() - start;
+
+        task.pause(spinners[0]);
+        start = cycles();
+        task.restart(spinners[0]);
+        restart += cycles() - start;
+    }
+    report("pause", running + RING_OVERHEAD, PAUSE_ITERATIONS, pause);
+    report("resume", running + RING_OVERHEAD, PAUSE_ITERATIONS, resume);
+    report("restart", running + RING_OVERHEAD, PAUSE_ITERATIONS, restart);
+
+    uint32_t start = cycles();
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        task.lock(&bench_mutex);
+        task.unlock(&bench_mutex);
+    }
+    report("mutex_lock_unlock", 0, PAUSE_ITERATIONS, cycles() - start);
+
+    // every spinner fighting over one lock, blocking vs. spinning
+    bench_contended(CONTEND_MUTEX, running);
+    bench_contended(CONTEND_SPIN_LOCK, running);
+
+    // give wakes one parked spinner which answers right away
+    contend = CONTEND_SEMAPHORE;
+    for (int i = 0; i < 100; i++) yield();
+    start = cycles();
+    for (int i = 0; i < PAUSE_ITERATIONS; i++) {
+        task.give(&ping);
+        task.take(&pong);
+    }
+    report("sem_round_trip", running, PAUSE_ITERATIONS, cycles() - start);
+    contend = 0;
+    for (int i = 0; i < running; i++) task.give(&ping);
+    for (int i = 0; i < 100; i++) yield();
+
+    // same lap with every spinner asleep, should cost about a ring of 2
+    sleep_us = 10000000;
+    for (int i = 0; i < 100; i++) yield();
+    start = cycles();
+    for (int i = 0; i < YIELD_LAPS; i++) yield();
+    report("yield_lap_sleeping", running + RING_OVERHEAD, YIELD_LAPS, cycles() - start);
+
+    for (int i = 0; i < num_spinners; i++) task.pause(spinners[i]);
+    Serial.println("# done");
+#if defined(ZILCH_HOST)
+    exit(0);
+#endif
+}
+/*******************************************************************/
+// lock handoff throughput and the longest any spinner waited
+static void bench_contended(int mode, int contenders) {
+    contend = mode;
+    for (int i = 0; i < 100; i++) yield();
+    acquisitions = 0;
+    wait_max = 0;
+    uint32_t start = cycles();
+    for (int i = 0; i < YIELD_LAPS; i++) yield();
+    uint32_t total = cycles() - start;
+    uint32_t count = acquisitions;
+    contend = 0;
+    // let every waiter get through before the next run
+    for (int i = 0; i < contenders * 4; i++) yield();
+
+    bool mutex = mode == CONTEND_MUTEX;
+    report(mutex ? "mutex_handoff" : "spin_lock_handoff", contenders, count, total);
+    report(mutex ? "mutex_wait_max" : "spin_lock_wait_max", contenders, 1, wait_max);
+}
@@ -28,6 +28,9 @@ void setup() {
     delay(100);
     Serial.println("Starting tasks now...");
     
+    // a task that runs low on stack is paused and reported here
+    task.lowMemoryCallback(lowMemory);
+    
     // create stacks
     task.create(worker, WORKER_STACK_SIZE, 0);
     task.create(task1, TASK1_STACK_SIZE, 0);
@@ -47,6 +50,15 @@ void loop() {
     delay(25);
 }
 /*******************************************************************/
+// called from the kernal task, not from inside the scheduler
+static void lowMemory(task_handle_t task, uint32_t free) {
+    Serial.print("Possible stack overflow, task ");
+    Serial.print(task.index);
+    Serial.print(" has ");
+    Serial.print(free);
+    Serial.println(" words of stack left and is paused");
+}
+/*******************************************************************/
 // First task
 static void worker(void *arg) {
     while ( 1 ) {
@@ -59,7 +59,7 @@ void loop() {
 static void task1(void *arg) {
     while ( 1 ) {
         Serial.println("task1");
-        delay(1000);
+        task.sleep(1000);
     }
 }
 /*******************************************************************/
@@ -67,7 +67,7 @@ static void task1(void *arg) {
 static void task2(void *arg) {
     while ( 1 ) {
         Serial.println("task2");
-        delay(1000);
+        task.sleep(1000);
     }
 }
 /*******************************************************************/
@@ -75,7 +75,7 @@ static void task2(void *arg) {
 static void task3(void *arg) {
     while ( 1 ) {
         Serial.println("task3");
-        delay(1000);
+        task.sleep(1000);
     }
 }
 /*******************************************************************/
@@ -83,7 +83,7 @@ static void task3(void *arg) {
 static void task4(void *arg) {
     while ( 1 ) {
         Serial.println("task4");
-        delay(1000);
+        task.sleep(1000);
     }
 }
 /*******************************************************************/
@@ -91,6 +91,6 @@ static void task4(void *arg) {
 static void task5(void *arg) {
     while ( 1 ) {
         Serial.println("task5");
-        delay(1000);
+        task.sleep(1000);
     }
 }
@@ -0,0 +1,128 @@
+/***********************************************************************************
+ * Lightweight Scheduler Library for Teensy LC/3.x
+ * Copyright (c) 2016, Colin Duffy https://github.com/duff2013
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ ***********************************************************************************
+ *  Arduino.h
+ *  Linux x86-64 host shim, just enough Teensyduino to build and run Zilch
+ *  and its examples as a normal process.
+ ***********************************************************************************/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZILCH_HOST
+
+typedef bool    boolean;
+typedef uint8_t byte;
+
+#define DMAMEM
+#define FASTRUN
+
+#define HIGH            1
+#define LOW             0
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+#define LED_BUILTIN     13
+
+#define DEC             10
+#define HEX             16
+#define OCT             8
+#define BIN             2
+
+// single threaded host, nothing to mask
+#define __disable_irq( ) asm volatile( "" ::: "memory" )
+#define __enable_irq( )  asm volatile( "" ::: "memory" )
+
+void     yield                  ( void );
+uint32_t millis                 ( void );
+uint32_t micros                 ( void );
+void     delay                  ( uint32_t msec );
+void     delayMicroseconds      ( uint32_t usec );
+// stands in for WFI, sleeps to the next 1ms tick like the SysTick interrupt
+void     host_wfi               ( void );
+void     pinMode                ( uint8_t pin, uint8_t mode );
+void     digitalWrite           ( uint8_t pin, uint8_t val );
+uint8_t  digitalRead            ( uint8_t pin );
+#define  digitalWriteFast       digitalWrite
+#define  digitalReadFast        digitalRead
+
+void setup( void );
+void loop ( void );
+
+class HostSerial {
+public:
+    void    begin   ( uint32_t baud ) { }
+    operator bool   ( void ) { return true; }
+    int     available( void ) { return 0; }
+    int     read    ( void ) { return -1; }
+    void    flush   ( void ) { }
+    size_t  write   ( uint8_t b );
+    size_t  write   ( const uint8_t *buffer, size_t size );
+    size_t  print   ( const char *s );
+    size_t  print   ( char c );
+    size_t  print   ( int n, int base = DEC );
+    size_t  print   ( unsigned int n, int base = DEC );
+    size_t  print   ( long n, int base = DEC );
+    size_t  print   ( unsigned long n, int base = DEC );
+    size_t  print   ( long long n, int base = DEC );
+    size_t  print   ( unsigned long long n, int base = DEC );
+    size_t  print   ( double n, int digits = 2 );
+    size_t  println ( void );
+    template <typename T> size_t println( T n ) {
+        size_t len = print( n );
+        return len + println( );
+    }
+    template <typename T> size_t println( T n, int base ) {
+        size_t len = print( n, base );
+        return len + println( );
+    }
+private:
+    size_t  printNumber( unsigned long long n, uint8_t base, bool negative );
+};
+extern HostSerial Serial;
+
+class elapsedMillis {
+public:
+    elapsedMillis( void ) { ms = millis( ); }
+    elapsedMillis( uint32_t val ) { ms = millis( ) - val; }
+    operator uint32_t ( ) const { return millis( ) - ms; }
+    elapsedMillis & operator = ( uint32_t val ) { ms = millis( ) - val; return *this; }
+private:
+    uint32_t ms;
+};
+
+class elapsedMicros {
+public:
+    elapsedMicros( void ) { us = micros( ); }
+    elapsedMicros( uint32_t val ) { us = micros( ) - val; }
+    operator uint32_t ( ) const { return micros( ) - us; }
+    elapsedMicros & operator = ( uint32_t val ) { us = micros( ) - val; return *this; }
+private:
+    uint32_t us;
+};
+
+#endif
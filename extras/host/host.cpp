@@ -0,0 +1,176 @@
+/***********************************************************************************
+ * Lightweight Scheduler Library for Teensy LC/3.x
+ * Copyright (c) 2016, Colin Duffy https://github.com/duff2013
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ ***********************************************************************************
+ *  host.cpp
+ *  Linux x86-64 host shim. Tasks run on small pool stacks, so nothing in
+ *  here may pull in stdio, output goes straight to write(2).
+ ***********************************************************************************/
+
+#include "Arduino.h"
+#include <time.h>
+#include <unistd.h>
+
+HostSerial Serial;
+
+static uint8_t pin_state[64];
+// --------------------------------------------------------------------------------------------
+static uint64_t monotonic_us( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const uint64_t start_us = monotonic_us( );
+// --------------------------------------------------------------------------------------------
+uint32_t millis( void ) {
+    return ( monotonic_us( ) - start_us ) / 1000;
+}
+
+uint32_t micros( void ) {
+    return monotonic_us( ) - start_us;
+}
+// --------------------------------------------------------------------------------------------
+// same as Teensyduino, delay keeps calling yield so other tasks run
+void delay( uint32_t msec ) {
+    uint32_t start = micros( );
+    while ( msec > 0 ) {
+        yield( );
+        while ( msec > 0 && ( micros( ) - start ) >= 1000 ) {
+            msec--;
+            start += 1000;
+        }
+    }
+}
+
+void delayMicroseconds( uint32_t usec ) {
+    uint32_t start = micros( );
+    while ( micros( ) - start < usec ) ;
+}
+
+void host_wfi( void ) {
+    usleep( 1000 - micros( ) % 1000 );
+}
+// --------------------------------------------------------------------------------------------
+void pinMode( uint8_t pin, uint8_t mode ) {
+
+}
+
+void digitalWrite( uint8_t pin, uint8_t val ) {
+    pin_state[pin & 63] = val ? HIGH : LOW;
+}
+
+uint8_t digitalRead( uint8_t pin ) {
+    return pin_state[pin & 63];
+}
+// --------------------------------------------------------------------------------------------
+size_t HostSerial::write( uint8_t b ) {
+    return write( &b, 1 );
+}
+
+size_t HostSerial::write( const uint8_t *buffer, size_t size ) {
+    size_t count = 0;
+    while ( count < size ) {
+        ssize_t n = ::write( STDOUT_FILENO, buffer + count, size - count );
+        if ( n <= 0 ) break;
+        count += n;
+    }
+    return count;
+}
+
+size_t HostSerial::print( const char *s ) {
+    return write( ( const uint8_t * )s, strlen( s ) );
+}
+
+size_t HostSerial::print( char c ) {
+    return write( ( uint8_t )c );
+}
+
+size_t HostSerial::print( int n, int base ) {
+    return print( ( long long )n, base );
+}
+
+size_t HostSerial::print( unsigned int n, int base ) {
+    return printNumber( n, base, false );
+}
+
+size_t HostSerial::print( long n, int base ) {
+    return print( ( long long )n, base );
+}
+
+size_t HostSerial::print( unsigned long n, int base ) {
+    return printNumber( n, base, false );
+}
+
+size_t HostSerial::print( long long n, int base ) {
+    if ( n < 0 && base == DEC ) return printNumber( -( unsigned long long )n, base, true );
+    return printNumber( ( unsigned long long )n, base, false );
+}
+
+size_t HostSerial::print( unsigned long long n, int base ) {
+    return printNumber( n, base, false );
+}
+
+size_t HostSerial::print( double n, int digits ) {
+    size_t len = 0;
+    if ( n < 0 ) {
+        len += print( '-' );
+        n = -n;
+    }
+    double rounding = 0.5;
+    for ( int i = 0; i < digits; i++ ) rounding /= 10.0;
+    n += rounding;
+    unsigned long long whole = ( unsigned long long )n;
+    double remainder = n - ( double )whole;
+    len += printNumber( whole, DEC, false );
+    if ( digits > 0 ) len += print( '.' );
+    while ( digits-- > 0 ) {
+        remainder *= 10.0;
+        int digit = ( int )remainder;
+        len += print( ( char )( '0' + digit ) );
+        remainder -= digit;
+    }
+    return len;
+}
+
+size_t HostSerial::println( void ) {
+    return print( "\r\n" );
+}
+
+size_t HostSerial::printNumber( unsigned long long n, uint8_t base, bool negative ) {
+    char buf[66];
+    char *str = &buf[sizeof( buf ) - 1];
+    *str = '\0';
+    if ( base < 2 ) base = DEC;
+    do {
+        uint8_t digit = n % base;
+        n /= base;
+        *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while ( n );
+    if ( negative ) *--str = '-';
+    return print( str );
+}
+// --------------------------------------------------------------------------------------------
+int main( void ) {
+    setup( );
+    for ( ;; ) loop( );
+    return 0;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+#  zilch_trace.py
+#  Decodes a Zilch::traceDump capture into a timeline.
+#
+#  Build with USE_TRACE uncommented in zilch.h, call task.traceDump()
+#  when something looks wrong and capture the serial port to a file:
+#
+#      cat /dev/ttyACM0 > capture.bin
+#      python3 extras/trace/zilch_trace.py capture.bin
+#
+#  Anything before the dump in the capture is skipped. Dump format, all
+#  little endian:
+#
+#      'ZTRC', version u8, record size u8, records u16, clock hz u32,
+#      records ever written u32, then the records oldest first:
+#      time u32, event u8, from u8, to u8, state u8
+#
+
+import struct
+import sys
+
+EVENTS = ["switch", "start", "return", "destroy", "pause", "resume"]
+STATES = ["created", "paused", "executing", "returned", "destroyable", "invalid"]
+NONE = 0xFF
+
+
+def find_dumps(data):
+    offset = data.find(b"ZTRC")
+    while offset >= 0:
+        version, size, count, hz, total = struct.unpack_from("<BBHII", data, offset + 4)
+        start = offset + 16
+        records = []
+        for i in range(count):
+            if start + (i + 1) * size > len(data):
+                break
+            records.append(struct.unpack_from("<IBBBB", data, start + i * size))
+        yield hz, total, records
+        offset = data.find(b"ZTRC", start + count * size)
+
+
+def name(index):
+    return "-" if index == NONE else "t%d" % index
+
+
+def timeline(hz, total, records, out):
+    if not records:
+        out.write("empty trace\n")
+        return
+    lost = total - len(records)
+    unit = "us" if hz else "cycles"
+    out.write("%d records, %d older ones overwritten, times in %s\n\n" % (len(records), lost, unit))
+
+    # one lane per task, '#' marks the one running
+    tasks = sorted({i for r in records for i in (r[2], r[3]) if i != NONE})
+    lane = {t: n for n, t in enumerate(tasks)}
+    header = " ".join("%3s" % name(t) for t in tasks)
+    out.write("%12s %10s  %s  %s\n" % ("time", "delta", header, "event"))
+
+    base = records[0][0]
+    last = base
+    running = None
+    for time, event, src, dst, state in records:
+        if event in (0, 1):
+            running = dst
+        marks = [" . "] * len(tasks)
+        if running is not None and running in lane:
+            marks[lane[running]] = " # "
+        what = EVENTS[event] if event < len(EVENTS) else "event %d" % event
+        if dst == NONE:
+            what += " %s" % name(src)
+        else:
+            what += " %s -> %s" % (name(src), name(dst))
+        if state < len(STATES):
+            what += " (%s)" % STATES[state]
+        # the clock is 32 bits, deltas wrap with it
+        since = (time - base) & 0xFFFFFFFF
+        delta = (time - last) & 0xFFFFFFFF
+        if hz:
+            since = since * 1e6 / hz
+            delta = delta * 1e6 / hz
+        out.write("%12.1f %10.1f  %s  %s\n" % (since, delta, " ".join(marks), what))
+        last = time
+        if event == 2 and src == running:
+            running = None
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: zilch_trace.py capture.bin\n")
+        return 2
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    found = False
+    for hz, total, records in find_dumps(data):
+        if found:
+            sys.stdout.write("\n")
+        timeline(hz, total, records, sys.stdout)
+        found = True
+    if not found:
+        sys.stderr.write("no trace dump found\n")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
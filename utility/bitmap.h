@@ -0,0 +1,84 @@
+//
+//  bitmap.h
+//  Teensyduino_3_5
+//
+//  Two level bitmap, a summary word over up to 32 words of bits so
+//  finding a set or clear bit is two CTZs however many bits there are.
+//
+
+#ifndef __bitmap__
+#define __bitmap__
+
+#include "Arduino.h"
+
+template <uint32_t BITS> struct bitmap_t {
+    static_assert( BITS > 0 && BITS <= 32 * 32, "bitmap_t holds 1 to 1024 bits" );
+    enum { WORDS = ( BITS + 31 ) / 32 };
+
+    uint32_t used;              // bit n set when word[n] has any bit set
+    uint32_t full;              // bit n set when word[n] has every bit set
+    uint32_t word[WORDS];
+
+    void reset( void ) {
+        used = 0;
+        full = 0;
+        for ( uint32_t i = 0; i < WORDS; i++ ) word[i] = 0;
+        // bits past BITS read as set so they are never handed out
+        if ( BITS % 32 ) {
+            word[WORDS - 1] = 0xFFFFFFFFu << ( BITS % 32 );
+        }
+    }
+
+    void set( uint32_t n ) {
+        uint32_t w = n >> 5;
+        word[w] |= 1UL << ( n & 31 );
+        used |= 1UL << w;
+        if ( word[w] == 0xFFFFFFFF ) full |= 1UL << w;
+    }
+
+    void clear( uint32_t n ) {
+        uint32_t w = n >> 5;
+        word[w] &= ~( 1UL << ( n & 31 ) );
+        full &= ~( 1UL << w );
+        if ( word[w] == tail_mask( w ) ) used &= ~( 1UL << w );
+    }
+
+    bool test( uint32_t n ) const {
+        return word[n >> 5] & ( 1UL << ( n & 31 ) );
+    }
+
+    // first set bit at or after n, -1 if none
+    int next( uint32_t n ) const {
+        if ( n >= BITS ) return -1;
+        uint32_t w = n >> 5;
+        uint32_t bits = ( word[w] & ~tail_mask( w ) ) & ( 0xFFFFFFFFu << ( n & 31 ) );
+        if ( bits ) return ( w << 5 ) + __builtin_ctz( bits );
+        uint32_t words = used & ( w == 31 ? 0 : 0xFFFFFFFFu << ( w + 1 ) );
+        while ( words ) {
+            w = __builtin_ctz( words );
+            bits = word[w] & ~tail_mask( w );
+            if ( bits ) return ( w << 5 ) + __builtin_ctz( bits );
+            words &= words - 1;
+        }
+        return -1;
+    }
+
+    int first( void ) const {
+        return next( 0 );
+    }
+
+    // first clear bit, -1 if every bit is set
+    int firstClear( void ) const {
+        uint32_t words = ~full & ( WORDS == 32 ? 0xFFFFFFFFu : ( 1UL << WORDS ) - 1 );
+        if ( words == 0 ) return -1;
+        uint32_t w = __builtin_ctz( words );
+        return ( w << 5 ) + __builtin_ctz( ~word[w] );
+    }
+
+private:
+    // padding bits of the last word, always set
+    static uint32_t tail_mask( uint32_t w ) {
+        return ( BITS % 32 && w == WORDS - 1 ) ? 0xFFFFFFFFu << ( BITS % 32 ) : 0;
+    }
+};
+#endif /* defined(__bitmap__) */
@@ -7,235 +7,197 @@
 //
 
 #include "mem_manager.h"
+#include <assert.h>
 
 uint32_t *mem_manager::pool     = NULL;
-uint16_t mem_manager::pool_size = 0;
+uint32_t mem_manager::pool_size = 0;
+uint32_t mem_manager::free_words = 0;
+uint32_t mem_manager::largest = 0;
+bool mem_manager::largest_stale = false;
+uint32_t mem_manager::class_map = 0;
+uint16_t mem_manager::class_head[32];
+uint16_t mem_manager::free_next[MEM_MAX_BLOCKS];
+uint16_t mem_manager::free_prev[MEM_MAX_BLOCKS];
+bitmap_t<MEM_MAX_BLOCKS> mem_manager::free_map;
+bitmap_t<MEM_MAX_BLOCKS> mem_manager::alloc_map;
 // --------------------------------------------------------------------------------------------
-void mem_manager::init( uint32_t *p, uint16_t len ) {
+void mem_manager::init( uint32_t *p, uint32_t len ) {
     pool_size = len;
     pool = p;
-    mem_block_t *ptr = ( mem_block_t * )p;
-    ptr->block = pool + 128;
-    ptr->length = len - 128;
-    uint32_t *start = ( uint32_t * )p + 2;
+    uint32_t *start = ( uint32_t * )p;
     uint32_t *end = ( uint32_t * )p + ( len );
     do {
         *start++ = 0;
     } while ( start != end );
-    uint32_t *freelist = pool + 127;
-    *freelist = 1;
-    //uint32_t *freelistMax = pool + 126;
-    //*freelistMax = ptr->length | 1 << 16;
+    free_map.reset( );
+    alloc_map.reset( );
+    class_map = 0;
+    for ( int i = 0; i < 32; i++ ) class_head[i] = MEM_NONE;
+    free_words = len - MEM_HEADER_WORDS;
+    largest = 0;
+    largest_stale = false;
+    free_insert( 0, pool + MEM_HEADER_WORDS, len - MEM_HEADER_WORDS );
+}
+// --------------------------------------------------------------------------------------------
+mem_block_t *mem_manager::alloc( uint32_t nwords ) {
+    // keep every block pointer aligned
+    nwords = ( nwords + MEM_TAG_WORDS - 1 ) & ~( MEM_TAG_WORDS - 1 );
+    
+    int index = alloc_map.firstClear( );
+    if ( index < 0 ) return NULL;
+    
+    int n = find_fit( nwords );
+    if ( n < 0 ) return NULL;
+    
+    // carve from the front, what is left stays free under the same entry
+    mem_block_t *p = freeList( ) + n;
+    uint32_t *memory = p->block;
+    uint32_t length = p->length;
+    free_remove( n );
+    if ( length > nwords ) free_insert( n, memory + nwords, length - nwords );
+    free_words -= nwords;
+    
+    mem_block_t *start = allocList( ) + index;
+    alloc_map.set( index );
+    *memory = index;// tag holds alloc list index
+    start->block = memory + MEM_TAG_WORDS;
+    start->length = nwords - MEM_TAG_WORDS;
+    return start;
 }
 // --------------------------------------------------------------------------------------------
 mem_block_t *mem_manager::alloc( uint32_t nwords, uint32_t fill_pattern ) {
-    
-    /*uint32_t *freelistMax   = pool + 126;
-    uint16_t free_block_len = *freelistMax & 0xFFFF;
-    uint16_t free_block_idx = ( *freelistMax & 0xFFFF0000 ) >> 16;
-    
-    if ( free_block_len < nwords ) {
-        uint32_t list = *( pool + 127 );
-        while( list ) {
-            int n = __builtin_ctz( list );
-            list &= ~( 1 << n );
-            mem_block_t *p = ( mem_block_t * )pool + n;
-            if ( p->length >= nwords ) {
-                free_block_len = p->length;
-                free_block_idx = 1 << n;
-                *freelistMax = p->length | 1 << (n + 16);
-                break;
-            }
-        }
-    }*/
-    
-    //free_block_len -= nwords;
-    //*freelistMax = free_block_len | (free_block_idx << 16);
-    
-    
-    mem_block_t *start = ( mem_block_t * )pool;
-    mem_block_t *end = ( mem_block_t * )pool + 32;
-    uint32_t *memory = NULL;
-    
-    uint32_t list = *( pool + 127 );
-    while( list ) {
-        int n = __builtin_ctz( list );
-        list &= ~( 1 << n );
-        mem_block_t *p = ( mem_block_t * )pool + n;
-        if ( p->length >= nwords ) {
-            memory = p->block;
-            p->block = p->block + nwords;
-            p->length = p->length - nwords;
-            if ( p->length == 0 ) {
-                p->block = 0;
-                uint32_t *freelist = pool + 127;
-                *freelist &= ~( 1 << n );
-            }
-            break;
-        }
+    mem_block_t *start = alloc( nwords );
+    if ( start != NULL ) fill( start->block, start->length, fill_pattern );
+    return start;
+}
+// --------------------------------------------------------------------------------------------
+void mem_manager::fill( uint32_t *p, uint32_t nwords, uint32_t pattern ) {
+    uint32_t *end = p + nwords;
+    // 8 stores a pass, becomes a single stm on Cortex-M
+    while ( end - p >= 8 ) {
+        p[0] = pattern; p[1] = pattern; p[2] = pattern; p[3] = pattern;
+        p[4] = pattern; p[5] = pattern; p[6] = pattern; p[7] = pattern;
+        p += 8;
     }
-    
-    /*uint32_t *freelistMax   = pool + 126;
-    list = *( pool + 127 );
-    uint32_t mysize = 0;
-    while ( list ) {
-        int n = __builtin_ctz( list );
-        list &= ~( 1 << n );
-        mem_block_t *p = ( mem_block_t * )pool + n;
-        if ( p->length > mysize ) {
-            *freelistMax = p->length | 1 << ( n + 16 );
-        }
-    }*/
-    
-    /*volatile int idx = 0;
-    do {
-        if ( start->length >= nwords ) {
-            memory = start->block;
-            start->block = start->block + nwords;
-            start->length = start->length - nwords;
-            if ( start->length == 0 ) {
-                uint32_t *freelist = pool + 127;
-                Serial.print("idx: ");
-                Serial.print(idx);
-                Serial.print(" | alloc1: ");
-                Serial.print(*freelist, BIN);
-                *freelist &= ~( 1 << idx );
-                Serial.print(" | alloc2: ");
-                Serial.println(*freelist, BIN);
-                delayMicroseconds(1000);
-                //Serial.println(idx);
-                start->block = 0;
-            }
-            break;
-        }
-        idx++;
-    } while ( ++start != end );*/
-    
-    if ( memory == NULL ) return NULL;
-    
-    start = ( mem_block_t * )pool + 32;
-    end = ( mem_block_t * )pool + 64;
-    do {
-        if ( start->block == 0 ) {
-            *memory = (uint32_t)start;
-            start->block = memory + 1;
-            start->length = nwords;
-            uint32_t *bottom = start->block;
-            uint32_t *top = start->block + nwords - 1;
-            do {
-                *bottom = fill_pattern;
-            } while ( ++bottom != top );
-            return start;
-        }
-    } while ( ++start != end );
-    return NULL;
+    while ( p != end ) *p++ = pattern;
 }
 // --------------------------------------------------------------------------------------------
 void mem_manager::free( uint32_t * p ) {
-
-    uint32_t list = *( pool + 127 ) ^ 0xFFFFFFFF;
-    int n = __builtin_ctz( list );
-    uint32_t *freelist = pool + 127;
-    *freelist |= ( 1 << n );
-    mem_block_t *freed = ( mem_block_t * )pool + n;
-    mem_block_t *allocated = ( mem_block_t * ) *( p - 1 );
-    freed->block = p - 1;
-    freed->length = allocated->length;
-    
-    /*uint32_t *freelistMax = pool + 126;
-    uint16_t free_block_len = *freelistMax & 0xFFFF;
-    if ( free_block_len < freed->length ) {
-        *freelistMax = freed->length | 1 << ( n + 16 );
-    }*/
-    
-    /*uint32_t *freelistMax   = pool + 126;
-    list = *( pool + 127 );
-    uint32_t mysize = 0;
-    while ( list ) {
-        int n = __builtin_ctz( list );
-        list &= ~( 1 << n );
-        mem_block_t *b = ( mem_block_t * )pool + n;
-        b = ( mem_block_t * )pool + n;
-        if ( b->length > mysize ) {
-            *freelistMax = b->length | 1 << ( n + 16 );
-        }
-    }*/
-    
+    uint32_t index = *( p - MEM_TAG_WORDS );
+    mem_block_t *allocated = allocList( ) + index;
+    uint32_t *block = p - MEM_TAG_WORDS;
+    uint32_t *end = p + allocated->length;
+    free_words += allocated->length + MEM_TAG_WORDS;
     allocated->block = 0;
     allocated->length = 0;
-    
-    
-    /*volatile int idx = 0;
-    do {
-        if ( start->block == 0 ) {
-            
-            if (start->block != t->block ) {
-                Serial.println("OUCH");
-                digitalWriteFast(LED_BUILTIN, HIGH);
-            }
-            volatile uint32_t *freelist = pool + 127;
-            *freelist |= ( 1 << idx );
-            
-            mem_block_t *freed = ( mem_block_t * )*( p - 1 );
-            start->block = p - 1;
-            start->length = freed->length;
-            freed->block = 0;
-            freed->length = 0;
-            return;
+    alloc_map.clear( index );
+    
+    // absorb the free block that starts where this one ends
+    if ( end != pool + pool_size ) {
+        int next = free_at( *end, end );
+        if ( next >= 0 ) {
+            end += freeList( )[next].length;
+            free_remove( next );
+        }
+    }
+    // and the free block that ends where this one starts
+    if ( block != pool + MEM_HEADER_WORDS ) {
+        int prev = free_at( *( block - 1 ), NULL );
+        if ( prev >= 0 && freeList( )[prev].block + freeList( )[prev].length == block ) {
+            block = freeList( )[prev].block;
+            free_remove( prev );
         }
-        idx++;
-    } while ( ++start != end );*/
+    }
+    // free blocks never touch so there is at most one more than allocated
+    // ones, with this block gone from the alloc list an entry is free
+    int n = free_map.firstClear( );
+    assert( n >= 0 );
+    free_insert( n, block, end - block );
 }
 // --------------------------------------------------------------------------------------------
 void mem_manager::combine_free_blocks( void ) {
-    mem_block_t *start = ( mem_block_t * )pool;
-    mem_block_t *end = ( mem_block_t * )pool + 32;
-    volatile int outer_idx = 0;
-    do {
-        if ( start->block != NULL ) {
-            mem_block_t *stmp = ( mem_block_t * )pool;
-            volatile int inner_idx = 0;
-            do {
-                if ( stmp->block + stmp->length == start->block && stmp->block != NULL ) {
-                    stmp->length += start->length;
-                    start->block = 0;
-                    start->length = 0;
-                    uint32_t *freelist = pool + 127;
-                    *freelist &= ~( 1 << outer_idx );
-                    
-                    /*uint32_t *freelistMax = pool + 126;
-                    uint16_t free_block_len = *freelistMax & 0xFFFF;
-                    if ( free_block_len < stmp->length ) {
-                        *freelistMax = stmp->length | 1 << ( 16 + outer_idx );
-                    }*/
-                }
-                inner_idx++;
-            } while ( ++stmp != end );
-        }
-        outer_idx++;
-    } while ( ++start != end) ;
-    
-    /*uint32_t *freelistMax   = pool + 126;
-    uint32_t list = *( pool + 127 );
-    uint32_t mysize = 0;
-    while ( list ) {
-        int n = __builtin_ctz( list );
-        list &= ~( 1 << n );
-        mem_block_t *b = ( mem_block_t * )pool + n;
-        b = ( mem_block_t * )pool + n;
-        if ( b->length > mysize ) {
-            *freelistMax = b->length | 1 << ( n + 16 );
+    // free merges with its neighbours, nothing is left to combine
+}
+// --------------------------------------------------------------------------------------------
+uint32_t mem_manager::freeWords( void ) {
+    return free_words;
+}
+// --------------------------------------------------------------------------------------------
+uint32_t mem_manager::largestFree( void ) {
+    // only scanned again after the largest block was split or merged,
+    // and then just the top size class, which has to hold it
+    if ( largest_stale ) {
+        largest = 0;
+        largest_stale = false;
+        if ( class_map == 0 ) return 0;
+        for ( uint16_t n = class_head[31 - __builtin_clz( class_map )]; n != MEM_NONE; n = free_next[n] ) {
+            if ( freeList( )[n].length > largest ) largest = freeList( )[n].length;
         }
-    }*/
+    }
+    return largest;
+}
+// --------------------------------------------------------------------------------------------
+int mem_manager::find_fit( uint32_t nwords ) {
+    uint32_t c = size_class( nwords );
+    // most recent free block of the same class, churn of same sized
+    // tasks keeps hitting this one
+    uint16_t n = class_head[c];
+    if ( n != MEM_NONE && freeList( )[n].length >= nwords ) return n;
+    // every block in a larger class fits, take the smallest class
+    uint32_t larger = c == 31 ? 0 : class_map & ( ~0UL << ( c + 1 ) );
+    if ( larger ) return class_head[__builtin_ctz( larger )];
+    // last resort before failing, a fit further down its own class
+    for ( ; n != MEM_NONE; n = free_next[n] ) {
+        if ( freeList( )[n].length >= nwords ) return n;
+    }
+    return -1;
+}
+// --------------------------------------------------------------------------------------------
+void mem_manager::free_insert( uint32_t n, uint32_t *block, uint32_t length ) {
+    mem_block_t *p = freeList( ) + n;
+    p->block = block;
+    p->length = length;
+    free_map.set( n );
+    // boundary tags, so free can find this block from either neighbour
+    *block = n;
+    *( block + length - 1 ) = n;
+    
+    uint32_t c = size_class( length );
+    free_prev[n] = MEM_NONE;
+    free_next[n] = class_head[c];
+    if ( class_head[c] != MEM_NONE ) free_prev[class_head[c]] = n;
+    class_head[c] = n;
+    class_map |= 1UL << c;
+    if ( !largest_stale && length > largest ) largest = length;
+}
+// --------------------------------------------------------------------------------------------
+void mem_manager::free_remove( uint32_t n ) {
+    mem_block_t *p = freeList( ) + n;
+    uint32_t c = size_class( p->length );
+    if ( free_prev[n] != MEM_NONE ) free_next[free_prev[n]] = free_next[n];
+    else class_head[c] = free_next[n];
+    if ( free_next[n] != MEM_NONE ) free_prev[free_next[n]] = free_prev[n];
+    if ( class_head[c] == MEM_NONE ) class_map &= ~( 1UL << c );
+    if ( p->length == largest ) largest_stale = true;
+    
+    p->block = 0;
+    p->length = 0;
+    free_map.clear( n );
+}
+// --------------------------------------------------------------------------------------------
+int mem_manager::free_at( uint32_t hint, uint32_t *start ) {
+    if ( hint >= MEM_MAX_BLOCKS || !free_map.test( hint ) ) return -1;
+    if ( start != NULL && freeList( )[hint].block != start ) return -1;
+    return hint;
 }
 
 //__attribute__((noinline))
-uint16_t mem_manager::poolSize( void ) {
+uint32_t mem_manager::poolSize( void ) {
     return pool_size;
 }
 
 //__attribute__((noinline))
 mem_block_t *mem_manager::allocList( void ) {
-    mem_block_t *p = ( mem_block_t * )pool + 32;
+    mem_block_t *p = ( mem_block_t * )pool + MEM_MAX_BLOCKS;
     return p;
 }
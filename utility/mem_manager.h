@@ -10,11 +10,31 @@
 #define __mem_manager__
 
 #include "Arduino.h"
+#include "bitmap.h"
 class mem_manager;
 
+/*****************************************************
+ * Most blocks the memory manager can track, every
+ * task stack and queue is one block. The pool header
+ * grows 4 words per block (8 on a 64 bit host), up
+ * to 1024 blocks. Set it with -D for the whole build,
+ * the library and the sketch have to agree on it.
+ *****************************************************/
+#ifndef MEM_MAX_BLOCKS
+#define MEM_MAX_BLOCKS 32
+#endif
+
+/*****************************************************
+ * Host builds scale every stack, x86-64 call frames
+ * are a lot bigger than Cortex-M ones.
+ *****************************************************/
+#ifndef ZILCH_STACK_SCALE
+#define ZILCH_STACK_SCALE 1
+#endif
+
 #define AllocateMemoryPool(len) ({                                                      \
-    static DMAMEM uint32_t mem_pool[( 256 + ( len - 1 ) - ( ( len - 1 ) % 128 )) + 512];\
-    mem_manager::init( mem_pool, ( 256 + ( len - 1 ) - ( ( len - 1 ) % 128 )) + 512 );  \
+    static DMAMEM uint32_t mem_pool[MEM_POOL_LENGTH( len )] __attribute__ ((aligned (8)));\
+    mem_manager::init( mem_pool, MEM_POOL_LENGTH( len ) );                              \
 })
 
 struct mem_block_t {
@@ -22,18 +42,55 @@ struct mem_block_t {
     uint32_t length;
 };
 
+// words per block entry, 2 on Cortex-M and 4 on a 64 bit host
+#define MEM_BLOCK_WORDS     ( sizeof( mem_block_t ) / sizeof( uint32_t ) )
+// words in front of every block, holds its alloc list index. It held
+// the entry's address before the host port, indices fit any pointer
+// size. A free block holds its free list index in its first and last
+// word instead.
+#define MEM_TAG_WORDS       ( sizeof( uintptr_t ) / sizeof( uint32_t ) )
+// end of a size class list
+#define MEM_NONE            0xFFFF
+// MEM_MAX_BLOCKS free list entries + MEM_MAX_BLOCKS alloc list entries
+#define MEM_HEADER_WORDS    ( 2 * MEM_MAX_BLOCKS * MEM_BLOCK_WORDS )
+#define MEM_POOL_LENGTH( len ) \
+    ( 2 * MEM_HEADER_WORDS + ( ( len ) * ZILCH_STACK_SCALE - 1 ) - ( ( ( len ) * ZILCH_STACK_SCALE - 1 ) % 128 ) + 512 * ZILCH_STACK_SCALE )
+
 class mem_manager {
 public:
     mem_manager( void ) { }
-    static void init( uint32_t *p, uint16_t len );
+    static void init( uint32_t *p, uint32_t len );
+    // nwords includes the tag and is rounded up to whole tags, the
+    // block gets what is left after the tag in its length
+    mem_block_t *alloc( uint32_t nwords );
     mem_block_t *alloc( uint32_t nwords, uint32_t fill_pattern );
+    static void fill( uint32_t *p, uint32_t nwords, uint32_t pattern );
     void free( uint32_t* p );
     void combine_free_blocks( void );
-    uint16_t poolSize( void );
+    uint32_t freeWords( void );
+    uint32_t largestFree( void );
+    uint32_t poolSize( void );
     mem_block_t *allocList( void );
     static uint32_t *pool;
 private:
+    static mem_block_t *freeList( void ) { return ( mem_block_t * )pool; }
+    // free list entry the boundary tag 'hint' names, if it is really free
+    static int free_at( uint32_t hint, uint32_t *start );
+    static int find_fit( uint32_t nwords );
+    static void free_insert( uint32_t n, uint32_t *block, uint32_t length );
+    static void free_remove( uint32_t n );
+    // free blocks of class c are 2^c to 2^(c+1)-1 words long
+    static uint32_t size_class( uint32_t length ) { return 31 - __builtin_clz( length ); }
     
-    static uint16_t pool_size;
+    static uint32_t pool_size;
+    static uint32_t free_words;                     // free words in the pool
+    static uint32_t largest;                        // longest free block, unless stale
+    static bool     largest_stale;                  // that block was taken, scan again
+    static uint32_t class_map;                      // non empty size classes
+    static uint16_t class_head[32];                 // first free entry per size class
+    static uint16_t free_next[MEM_MAX_BLOCKS];      // size class list links
+    static uint16_t free_prev[MEM_MAX_BLOCKS];
+    static bitmap_t<MEM_MAX_BLOCKS> free_map;   // used free list entries
+    static bitmap_t<MEM_MAX_BLOCKS> alloc_map;  // used alloc list entries
 };
 #endif /* defined(__mem_manager__) */
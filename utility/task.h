@@ -39,12 +39,174 @@
  *****************************************************/
 
 typedef void ( * task_func_t )( void *arg );
+typedef void *( * task_result_func_t )( void *arg );
+//////////////////////////////////////////////////////////////////////
+// Task handle - returned by create, a failed create or a destroyed
+// task's handle reads back as TaskInvalid.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint16_t index;         // task table slot
+    uint16_t generation;    // bumped every create, 0 is never handed out
+} task_handle_t;
+//////////////////////////////////////////////////////////////////////
+// Task run time stats - in CPU cycles, the Teensy LC has no cycle
+// counter so its are micros() scaled to cycles.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint64_t    run_cycles;     // total time the task has run
+    uint32_t    switches;       // times the task was switched in
+    uint32_t    longest_run;    // longest stretch between two yields
+} task_stats_t;
+//////////////////////////////////////////////////////////////////////
+// Idle stats - in microseconds, busy percent is
+// 100 - idle_us * 100 / elapsed_us.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint64_t    idle_us;        // time spent waiting for an interrupt
+    uint64_t    elapsed_us;     // time since begin or the last reset
+    uint32_t    sleeps;         // times the kernal went idle
+} task_idle_t;
+//////////////////////////////////////////////////////////////////////
+// Trace record - 'from' and 'to' are task table indices, 0xFF for
+// none. See extras/trace/zilch_trace.py for the dump format.
+//////////////////////////////////////////////////////////////////////
+enum TraceEvent {
+    TraceSwitch,        // yield switched from one task to another
+    TraceStart,         // yield switched to a task starting from the top
+    TraceReturn,        // task function returned
+    TraceDestroy,       // destroyable task's memory freed
+    TracePause,         // 'from' paused 'to'
+    TraceResume         // 'from' resumed 'to'
+};
+
+typedef struct {
+    uint32_t    time;       // same clock as the task stats
+    uint8_t     event;      // TraceEvent
+    uint8_t     from;
+    uint8_t     to;
+    uint8_t     state;      // state after the event of 'to', or 'from' if there is no 'to'
+} task_trace_t;
+// low memory callback, gets the paused task and its untouched stack words
+typedef void ( * task_memory_func_t )( task_handle_t task, uint32_t free );
+//////////////////////////////////////////////////////////////////////
+// Blocking mutex - waiters are parked off the run list in FIFO order
+// and unlock hands ownership straight to the first one. Not recursive.
+//////////////////////////////////////////////////////////////////////
+struct stack_frame_t;
+typedef struct task_mutex_t {
+    struct stack_frame_t *owner;        // NULL when unlocked
+    struct stack_frame_t *head;         // first waiter
+    struct stack_frame_t *tail;         // last waiter
+    struct task_mutex_t  *owned_next;   // next mutex held by the owner
+} task_mutex_t;
+//////////////////////////////////////////////////////////////////////
+// Counting semaphore - give is safe from an ISR, the waiting task is
+// put back on the run list by the next yield. Start with a count by
+// initializing it: task_sem_t sem = { 1 };
+//////////////////////////////////////////////////////////////////////
+typedef struct task_sem_t {
+    volatile uint32_t       count;      // gives not yet taken
+    struct stack_frame_t    *head;      // first waiter
+    struct stack_frame_t    *tail;      // last waiter
+    struct task_sem_t       *post_next; // next posted semaphore
+    volatile uint8_t        posted;     // on the posted list
+} task_sem_t;
+//////////////////////////////////////////////////////////////////////
+// Event flag group - 32 flags, set is safe from an ISR, waiters wake
+// on any or all of their flags.
+//////////////////////////////////////////////////////////////////////
+typedef struct task_event_t {
+    volatile uint32_t       flags;      // currently set flags
+    struct stack_frame_t    *head;      // first waiter
+    struct stack_frame_t    *tail;      // last waiter
+    struct task_event_t     *post_next; // next posted event group
+    volatile uint8_t        posted;     // on the posted list
+} task_event_t;
+//////////////////////////////////////////////////////////////////////
+// Future - filled in by a task made with createFuture when its
+// function returns, it outlives the task so a destroyable task's
+// result can still be read after its memory is freed. createFuture
+// sets every field, it needs no initializing.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    task_result_func_t      func;       // the task function, set by createFuture
+    void                    *value;     // what func returned, once ready
+    task_event_t            ready;      // flag 1 set when func has returned
+} task_future_t;
+//////////////////////////////////////////////////////////////////////
+// Software timer - func runs from the shared timer task when the
+// period is up, once or every period. Zero initialize it, the timer
+// calls fill in the rest. Not for use from an ISR.
+//////////////////////////////////////////////////////////////////////
+typedef struct task_timer_t {
+    task_func_t             func;       // called from the timer task
+    void                    *arg;       // passed to func
+    uint32_t                wake;       // micros() deadline while active
+    uint32_t                period;     // micros between runs
+    struct task_timer_t     *next;      // next timer, sorted by deadline
+    uint8_t                 reload;     // run every period instead of once
+    uint8_t                 active;     // on the timer list
+} task_timer_t;
+//////////////////////////////////////////////////////////////////////
+// Bounded message queue - fixed size slots from the memory pool that
+// are filled and read in place. Producers reserve and commit, consumers
+// receive and release, both wait off the run list when they can't.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    uint8_t         *buffer;        // capacity slots of slot_size bytes
+    uint8_t         *done;          // per slot, committed or released out of order
+    uint16_t        slot_size;      // bytes per slot, word rounded
+    uint16_t        capacity;       // number of slots
+    uint16_t        reserve_index;  // next slot handed to a producer
+    uint16_t        commit_index;   // next slot to become readable
+    uint16_t        receive_index;  // next slot handed to a consumer
+    uint16_t        release_index;  // next slot to become writable
+    task_sem_t      items;          // readable slots not yet received
+    task_sem_t      slots;          // writable slots not yet reserved
+} task_queue_t;
+//////////////////////////////////////////////////////////////////////
+// Worker pool - a few worker tasks run submitted jobs to completion,
+// one at a time each, taking them from a shared queue in order.
+//////////////////////////////////////////////////////////////////////
+typedef struct {
+    task_func_t     func;
+    void            *arg;
+    task_sem_t      *done;          // given when func returns, may be NULL
+} task_job_t;
+
+typedef struct {
+    task_queue_t    jobs;           // task_job_t slots
+    task_event_t    idle;           // flag set when pending drops to 0
+    uint32_t        pending;        // submitted and not finished yet
+} task_pool_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
     inline uint32_t sys_acquire_lock( volatile unsigned int *lock_var );
     inline uint32_t sys_release_lock( volatile unsigned int *lock_var );
+    void     task_mutex_lock    ( task_mutex_t *mutex );
+    void     task_mutex_unlock  ( task_mutex_t *mutex );
+    uint32_t task_mutex_trylock ( task_mutex_t *mutex );
+    void     task_sem_give      ( task_sem_t *sem );
+    void     task_sem_take      ( task_sem_t *sem );
+    uint32_t task_sem_trytake   ( task_sem_t *sem );
+    void     task_event_set     ( task_event_t *event, uint32_t flags );
+    void     task_event_clear   ( task_event_t *event, uint32_t flags );
+    uint32_t task_event_wait    ( task_event_t *event, uint32_t flags, uint32_t all, uint32_t clear );
+    uint32_t task_defer         ( task_func_t func, void *arg );
+    void     task_timer_start   ( task_timer_t *timer, uint32_t us );
+    void     task_timer_stop    ( task_timer_t *timer );
+    uint32_t task_queue_create  ( task_queue_t *queue, uint32_t slot_size, uint32_t capacity );
+    void     task_queue_destroy ( task_queue_t *queue );
+    void    *task_queue_reserve ( task_queue_t *queue, uint32_t wait );
+    void     task_queue_commit  ( task_queue_t *queue, void *slot );
+    void    *task_queue_receive ( task_queue_t *queue, uint32_t wait );
+    void     task_queue_release ( task_queue_t *queue, void *slot );
+    void     task_pool_worker   ( void *pool );
+    uint32_t task_pool_submit   ( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done, uint32_t wait );
+    void     task_pool_batch    ( task_pool_t *pool, task_func_t func, void **args, uint32_t n, task_sem_t *done );
+    void     task_pool_wait     ( task_pool_t *pool );
 #ifdef __cplusplus
 }
 #endif
@@ -77,6 +239,20 @@ extern inline uint32_t sys_release_lock( volatile unsigned int *lock ) {
     //__enable_irq();
     return *lock;
 }
+#ifdef __cplusplus
+//////////////////////////////////////////////////////////////////////
+// TASK_LOCK on a task_mutex_t blocks instead of spinning
+//////////////////////////////////////////////////////////////////////
+inline uint32_t sys_acquire_lock( task_mutex_t *mutex ) {
+    task_mutex_lock( mutex );
+    return 1;
+}
+
+inline uint32_t sys_release_lock( task_mutex_t *mutex ) {
+    task_mutex_unlock( mutex );
+    return 0;
+}
+#endif
 //////////////////////////////////////////////////////////////////////
 // Task Struct - save register
 //////////////////////////////////////////////////////////////////////
@@ -0,0 +1,126 @@
+/***********************************************************************************
+ * Lightweight Scheduler Library for Teensy LC/3.x
+ * Copyright (c) 2016, Colin Duffy https://github.com/duff2013
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ ***********************************************************************************
+ *  task_ring.h
+ *  Teensy 3.x/LC
+ ***********************************************************************************/
+
+#ifndef TASK_RING_h
+#define TASK_RING_h
+
+#include "task.h"
+/*****************************************************
+ * head and tail each get their own cache line so the
+ * producer and consumer don't share one, Teensy 3.x/LC
+ * have no data cache so a word is enough there.
+ *****************************************************/
+#if defined(__x86_64__)
+#define TASK_RING_ALIGN 64
+#else
+#define TASK_RING_ALIGN 4
+#endif
+//////////////////////////////////////////////////////////////////////
+// Lock free single producer, single consumer ring buffer. The producer
+// side never blocks or yields so it can run in an ISR, the consumer can
+// wait off the run list until enough data is pending. SIZE must be a
+// power of two.
+//////////////////////////////////////////////////////////////////////
+template <typename T, uint32_t SIZE> class TaskRing {
+    static_assert( SIZE > 0 && ( SIZE & ( SIZE - 1 ) ) == 0, "TaskRing SIZE must be a power of two" );
+public:
+    TaskRing                    ( void ) : head( 0 ), tail( 0 ), wanted( 0 ), ready( ) { }
+    //////////////////////////////////////////////////////////////////
+    // producer, ISR safe
+    //////////////////////////////////////////////////////////////////
+    bool write( const T &item ) {
+        return write( &item, 1 ) == 1;
+    }
+    // copies as many as fit, returns how many
+    uint32_t write( const T *src, uint32_t n ) {
+        uint32_t h = head;
+        uint32_t space = SIZE - ( h - __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) );
+        if ( n > space ) n = space;
+        for ( uint32_t i = 0; i < n; i++ ) buffer[( h + i ) & ( SIZE - 1 )] = src[i];
+        // publish, then see if the consumer is parked waiting for it
+        __atomic_store_n( &head, h + n, __ATOMIC_SEQ_CST );
+        uint32_t want = __atomic_load_n( &wanted, __ATOMIC_SEQ_CST );
+        if ( want != 0 && h + n - tail >= want ) {
+            wanted = 0;
+            task_sem_give( &ready );
+        }
+        return n;
+    }
+    uint32_t space( void ) {
+        return SIZE - ( head - __atomic_load_n( &tail, __ATOMIC_ACQUIRE ) );
+    }
+    //////////////////////////////////////////////////////////////////
+    // consumer, task context only
+    //////////////////////////////////////////////////////////////////
+    uint32_t available( void ) {
+        return __atomic_load_n( &head, __ATOMIC_ACQUIRE ) - tail;
+    }
+    bool read( T &item ) {
+        return read( &item, 1 ) == 1;
+    }
+    // batched read, copies up to n, returns how many
+    uint32_t read( T *dst, uint32_t n ) {
+        uint32_t t = tail;
+        uint32_t count = __atomic_load_n( &head, __ATOMIC_ACQUIRE ) - t;
+        if ( n > count ) n = count;
+        for ( uint32_t i = 0; i < n; i++ ) dst[i] = buffer[( t + i ) & ( SIZE - 1 )];
+        __atomic_store_n( &tail, t + n, __ATOMIC_RELEASE );
+        return n;
+    }
+    // zero copy batched read, points at the oldest items and returns
+    // how many are contiguous there, hand them back with consume
+    uint32_t peek( T **items ) {
+        uint32_t t = tail;
+        uint32_t count = __atomic_load_n( &head, __ATOMIC_ACQUIRE ) - t;
+        uint32_t to_end = SIZE - ( t & ( SIZE - 1 ) );
+        *items = &buffer[t & ( SIZE - 1 )];
+        return count < to_end ? count : to_end;
+    }
+    void consume( uint32_t n ) {
+        __atomic_store_n( &tail, tail + n, __ATOMIC_RELEASE );
+    }
+    // wait off the run list until at least n items are pending,
+    // returns how many are
+    uint32_t wait( uint32_t n = 1 ) {
+        if ( n > SIZE ) n = SIZE;
+        while ( 1 ) {
+            __atomic_store_n( &wanted, n, __ATOMIC_SEQ_CST );
+            uint32_t count = __atomic_load_n( &head, __ATOMIC_SEQ_CST ) - tail;
+            if ( count >= n ) {
+                wanted = 0;
+                return count;
+            }
+            task_sem_take( &ready );
+        }
+    }
+private:
+    volatile uint32_t head __attribute__ ( ( aligned ( TASK_RING_ALIGN ) ) );  // written by the producer
+    volatile uint32_t tail __attribute__ ( ( aligned ( TASK_RING_ALIGN ) ) );  // written by the consumer
+    volatile uint32_t wanted;           // items the parked consumer waits for, 0 if none
+    task_sem_t        ready;            // given once wanted is reached
+    T                 buffer[SIZE] __attribute__ ( ( aligned ( TASK_RING_ALIGN ) ) );
+};
+#endif
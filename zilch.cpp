@@ -29,8 +29,23 @@
 #include "utility/mem_manager.h"
 #include "Arduino.h"
 
+// what a queued frame's wait_on points to
+enum WaitKind {
+    WaitMutex,          // task_mutex_t
+    WaitSemaphore,      // task_sem_t
+    WaitEvent,          // task_event_t
+    WaitJoin            // stack_frame_t of the task being joined
+};
+
 struct stack_frame_t {
     uint32_t        *sp;            // Saved sp register
+#if defined(__x86_64__)
+    uint64_t        rbx;            // Host callee saved registers
+    uint64_t        rbp;
+    uint64_t        r13;
+    uint64_t        r14;
+    uint64_t        r15;
+#else
     uint32_t        r4;
     uint32_t        r5;
     uint32_t        r6;
@@ -39,6 +54,7 @@ struct stack_frame_t {
     uint32_t        r9;
     uint32_t        r10;
     uint32_t        r11;
+#endif
     uint32_t        *r12;           // Scratch Register holds stack frame
     uint32_t        *lr;            // Return address (pc)
     uint32_t        address;        // Address for swap fifo
@@ -49,17 +65,116 @@ struct stack_frame_t {
     void            *arg;           // Startup arg value
     enum TaskState  state;          // Current task state
     stack_frame_t   *next;          // points to next tasks memory section
+    stack_frame_t   *prev;          // previous task in the run list, NULL when not in it
+    task_handle_t   handle;         // task table slot and generation
+    uint32_t        wake;           // micros() deadline while sleeping
+    stack_frame_t   *wake_next;     // next sleeper, sorted by deadline
+    boolean         sleeping;       // on the sleep list
+    uint8_t         priority;       // ready list level, 0 is lowest
+    uint8_t         base_priority;  // level set by the user, before inheritance
+    stack_frame_t   *wait_next;     // next task waiting on the same mutex, semaphore or event
+    void            *wait_on;       // mutex, semaphore, event or task queued on, NULL if none
+    uint8_t         wait_kind;      // WaitKind, what wait_on points to
+    task_mutex_t    *owned;         // mutexes held, linked by owned_next
+    uint32_t        wait_flags;     // event flags waited on
+    boolean         wait_all;       // wait for all of wait_flags instead of any
+    boolean         watermark;      // stack is filled and checked by the kernal
+    boolean         refill;         // restarted, fill the stack again before it runs
+    uint32_t        *high_water;    // lowest stack word seen written
+    uint32_t        *scan;          // next word below high_water to check
+#if defined(USE_TASK_STATS)
+    task_stats_t    stats;          // run time, switches and longest run
+#endif
+    boolean         fpu;            // s16-s31 are pushed on this task's stack when it's switched out
+    stack_frame_t   *joiners;       // tasks parked in join, linked by wait_next
+    task_future_t   *future;        // set by createFuture, gets the return value
 };
 
+// every task stack is a memory manager block
+#define TASK_TABLE_SIZE MEM_MAX_BLOCKS
+#if defined(USE_STACK_GUARD)
+#if defined(__MK64FX512__) || defined(__MK66FX1M0__)
+#define STACK_GUARD
+#define SYSMPU_CESR             ( *( volatile uint32_t * )0x4000D000 )
+#define SYSMPU_RGD( n, word )   ( *( volatile uint32_t * )( 0x4000D400 + ( n ) * 16 + ( word ) * 4 ) )
+#define SYSMPU_RGDAAC( n )      ( *( volatile uint32_t * )( 0x4000D800 + ( n ) * 4 ) )
+#define SYSMPU_SPERR            0xF8000000  // a slave port saw a violation
+#define GUARD_BYTES             32          // MPU region granularity
+#define GUARD_ACCESS            0x000001C7  // core and debugger read/write/execute
+#else
+#warning "USE_STACK_GUARD needs the system MPU of a Teensy 3.5 or 3.6"
+#endif
+#endif
+// stack words the kernal checks for the fill pattern each turn
+#ifndef STACK_SCAN_WORDS
+#define STACK_SCAN_WORDS 32
+#endif
+// a sleeper due sooner than this is spun for, SysTick may not wake us in time
+#ifndef IDLE_MIN_US
+#define IDLE_MIN_US 1000
+#endif
+static_assert( ( DEFER_QUEUE_SIZE & ( DEFER_QUEUE_SIZE - 1 ) ) == 0 && DEFER_QUEUE_SIZE <= 0x8000,
+              "DEFER_QUEUE_SIZE must be a power of two" );
+static_assert( TASK_PRIORITY_LEVELS > 0 && TASK_PRIORITY_LEVELS <= 32,
+              "ready_map has one bit per priority level" );
+#if defined(USE_TRACE)
+static_assert( ( TRACE_RECORDS & ( TRACE_RECORDS - 1 ) ) == 0, "TRACE_RECORDS must be a power of two" );
+static_assert( TASK_TABLE_SIZE < 0xFF, "trace records hold 8 bit task indices" );
+#endif
+#if defined(USE_TASK_STATS) || defined(USE_TRACE)
+#define TASK_CYCLES
+#endif
+// Teensy 3.5/3.6, save the callee saved FPU registers of tasks that use it
+#if defined(KINETISK) && defined(__ARM_FP)
+#define TASK_FPU
+#endif
+
+// deferred work item, queued by an ISR for the timer task
+typedef struct {
+    task_func_t             func;
+    void                    *arg;
+} task_defer_t;
+
 typedef struct {
     uint32_t                memory_fill_pattern;
     uint32_t                memory_water_mark;
+    task_memory_func_t      low_memory;             // called when a task hits the water mark
     volatile stack_frame_t  *current_frame;
     stack_frame_t           *root_frame;
-    uint8_t                 num_task;
+    uint16_t                num_task;
     boolean                 begin;
     boolean                 tasks_to_destroy;
+    uint16_t                generation;             // last handle generation
+    bitmap_t<TASK_TABLE_SIZE> task_map;             // used task table slots
+    stack_frame_t           *task[TASK_TABLE_SIZE]; // frames by handle index
+    stack_frame_t           *sleep_list;            // earliest deadline first
+    task_timer_t            *timer_list;            // active software timers, earliest first
+    stack_frame_t           *timer_task;            // runs the timer callbacks and deferred work
+    task_defer_t            defer[DEFER_QUEUE_SIZE];// ring, indices wrap around it
+    volatile uint16_t       defer_read;             // next item the timer task runs
+    volatile uint16_t       defer_write;            // next free slot for an ISR
+    uint32_t                defer_dropped;          // defers refused, queue was full
+    task_event_t            defer_event;            // timer task waits on it for work
+    task_sem_t * volatile   sem_posted;             // given since the last yield
+    task_event_t * volatile event_posted;           // set since the last yield
+    uint32_t                ready_map;              // non empty ready levels
+    stack_frame_t           *ready[TASK_PRIORITY_LEVELS]; // next to run per level
     mem_manager             mem;
+#if defined(USE_TASK_STATS)
+    uint32_t                run_start;              // cycle count at the last yield
+#endif
+#if defined(USE_TRACE)
+    task_trace_t            trace[TRACE_RECORDS];   // ring, trace_count wraps around it
+    uint32_t                trace_count;            // records ever written
+    boolean                 trace_off;              // held still while it is dumped
+#endif
+#if defined(STACK_GUARD)
+    uint8_t                 guard_pair;             // MPU regions in use, 1-2 or 3-4
+#endif
+#if defined(USE_IDLE_SLEEP)
+    task_idle_t             idle;                   // time waiting for interrupts
+    uint32_t                idle_mark;              // micros() elapsed_us counts from
+#endif
 } os_t;
 
 #ifdef __cplusplus
@@ -70,19 +185,40 @@ extern "C" {
     void      start_os                 ( void );
     void      task_sync                ( void );
     void      task_restart_all         ( void );
-    TaskState task_state               ( task_func_t func );
-    TaskState task_restart             ( task_func_t func );
-    TaskState task_pause               ( task_func_t func );
-    TaskState task_resume              ( task_func_t func );
+    TaskState task_state               ( stack_frame_t *p );
+    TaskState task_restart             ( stack_frame_t *p );
+    TaskState task_pause               ( stack_frame_t *p );
+    TaskState task_resume              ( stack_frame_t *p );
     TaskState task_stop                ( task_func_t func );
-    uint32_t  task_memory              ( task_func_t func );
+    TaskState task_join                ( task_handle_t handle );
+    void      task_joined              ( stack_frame_t *p );
+    uint32_t  task_memory              ( stack_frame_t *p );
+    void      task_refill              ( stack_frame_t *p );
     void      destroy_task             ( int index );
     __attribute__((noinline))
-    stack_frame_t *remove_task_from_runlist2( volatile stack_frame_t *t );
-    __attribute__((noinline))
-    stack_frame_t *remove_task_from_runlist ( task_func_t func );
-    __attribute__((noinline))
-    stack_frame_t *add_task_to_runlist      ( task_func_t func );
+    stack_frame_t *remove_task_from_runlist( volatile stack_frame_t *t );
+    stack_frame_t *task_frame               ( task_handle_t handle );
+    stack_frame_t *find_task                ( task_func_t func );
+    void      ready_insert             ( stack_frame_t *p );
+    void      ready_push               ( stack_frame_t *p );
+    TaskState task_priority            ( stack_frame_t *p, uint8_t level );
+    void      ready_level              ( stack_frame_t *p, uint8_t level );
+    void      ready_remove             ( stack_frame_t *p );
+    void      task_sleep               ( uint32_t us );
+    void      task_wake                ( void );
+    void      task_posted              ( void );
+    void      wait_push                ( stack_frame_t *woke );
+    void      wait_cancel              ( stack_frame_t *p );
+    void      mutex_release_all        ( stack_frame_t *p );
+    void      timer_arm                ( task_timer_t *timer, uint32_t wake );
+    void      timer_schedule           ( void );
+    void      timer_insert             ( stack_frame_t *p );
+    boolean   timer_remove             ( stack_frame_t *p );
+#if defined(__x86_64__)
+    void      task_start               ( void );
+    void      task_run                 ( stack_frame_t *p );
+    void      task_swap                ( volatile stack_frame_t *prevframe, volatile stack_frame_t *nextframe );
+#endif
     
 #ifdef __cplusplus
 }
@@ -90,63 +226,274 @@ extern "C" {
 
 static os_t os __attribute__ ((aligned (4)));
 
+static const task_handle_t invalid_handle = { 0, 0 };
+#if defined(TASK_CYCLES)
+//////////////////////////////////////////////////////////////////////
+// cycle counter for the task stats and trace
+//////////////////////////////////////////////////////////////////////
+static inline uint32_t task_cycles( void ) {
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc( );
+#elif defined(KINETISK)
+    return ARM_DWT_CYCCNT;
+#else
+    return micros( ) * ( F_CPU / 1000000 );
+#endif
+}
+#endif
+
+#if defined(USE_TRACE)
+//////////////////////////////////////////////////////////////////////
+// one record is a masked index, the clock read and six stores: the
+// count and the time, event, from, to and state fields.
+//////////////////////////////////////////////////////////////////////
+static inline void trace( uint8_t event, volatile stack_frame_t *from, volatile stack_frame_t *to ) {
+    if ( os.trace_off ) return;
+    task_trace_t *t = &os.trace[os.trace_count++ & ( TRACE_RECORDS - 1 )];
+    volatile stack_frame_t *about = to != NULL ? to : from;
+    t->time  = task_cycles( );
+    t->event = event;
+    t->from  = from != NULL ? from->handle.index : 0xFF;
+    t->to    = to != NULL ? to->handle.index : 0xFF;
+    t->state = about != NULL ? about->state : TaskInvalid;
+}
+#define TRACE( event, from, to ) trace( event, from, to )
+#else
+#define TRACE( event, from, to )
+#endif
+//////////////////////////////////////////////////////////////////////
+// mask interrupts, keeping the caller's mask so ISRs can use these too
+//////////////////////////////////////////////////////////////////////
+static inline uint32_t irq_save( void ) {
+#if defined(__x86_64__)
+    asm volatile( "" ::: "memory" );
+    return 0;
+#else
+    uint32_t primask;
+    asm volatile( "MRS %[primask], PRIMASK" "\n\t"
+                  "CPSID i"                 "\n"
+                  : [primask] "=r" ( primask )
+                  :
+                  : "memory" );
+    return primask;
+#endif
+}
+
+static inline void irq_restore( uint32_t primask ) {
+#if defined(__x86_64__)
+    asm volatile( "" ::: "memory" );
+#else
+    asm volatile( "MSR PRIMASK, %[primask]" "\n"
+                  :
+                  : [primask] "r" ( primask )
+                  : "memory" );
+#endif
+}
+
 static void kernal( void *arg );
+static void timer_service( void *arg );
+static void future_run( void *arg );
+#if defined(USE_IDLE_SLEEP)
+static void task_idle( void );
+static void idle_account( void );
+#endif
+#if defined(STACK_GUARD)
+static void guard_init( void );
+static void guard_set( volatile stack_frame_t *p );
+#endif
+// reads other tasks' live stack frames, which asan keeps poisoned
+static void stack_scan( stack_frame_t *p ) __attribute__((no_sanitize_address));
 
 Zilch::Zilch( uint32_t override_pattern ) {
     os.memory_water_mark = 4;
     init_stack( override_pattern );
 }
 
-TaskState Zilch::create( task_func_t task, size_t stack_size, void *arg ) {
+task_handle_t Zilch::create( task_func_t task, size_t stack_size, void *arg, bool watermark ) {
     mem_block_t *block;
     if ( os.root_frame == NULL ) {
-        block = os.mem.alloc( 512, os.memory_fill_pattern );
-        if ( block == NULL ) return TaskInvalid;
-        task_create( kernal, block, arg );
+        block = os.mem.alloc( 512 * ZILCH_STACK_SCALE, os.memory_fill_pattern );
+        if ( block == NULL ) return invalid_handle;
+        task_create( kernal, block, arg )->watermark = true;
         os.num_task = 1;
     }
     uint32_t num = os.num_task; // get current number of tasks
-    block = os.mem.alloc( stack_size, os.memory_fill_pattern );
-    if ( block == NULL ) return TaskInvalid;
+    // skipping the fill makes creating a big stack nearly free
+    if ( watermark ) block = os.mem.alloc( stack_size * ZILCH_STACK_SCALE, os.memory_fill_pattern );
+    else block = os.mem.alloc( stack_size * ZILCH_STACK_SCALE );
+    if ( block == NULL ) return invalid_handle;
     stack_frame_t *p = task_create( task, block, arg );
+    if ( p == NULL ) {
+        os.mem.free( block->block );
+        return invalid_handle;
+    }
+    p->watermark = watermark;
     os.num_task = ++num;// total number of tasks
-    return p->state;
+    return p->handle;
 }
 
-TaskState Zilch::createDestroyable ( task_func_t task, size_t stack_size, void *arg ) {
+task_handle_t Zilch::createDestroyable ( task_func_t task, size_t stack_size, void *arg, bool watermark ) {
     mem_block_t *block;
     if ( os.root_frame == NULL ) {
-        block = os.mem.alloc( 512, os.memory_fill_pattern );
-        if ( block == NULL ) return TaskInvalid;
-        task_create( kernal, block, arg );
+        block = os.mem.alloc( 512 * ZILCH_STACK_SCALE, os.memory_fill_pattern );
+        if ( block == NULL ) return invalid_handle;
+        task_create( kernal, block, arg )->watermark = true;
         os.num_task = 1;
     }
     uint32_t num = os.num_task; // get current number of tasks
-    block = os.mem.alloc( stack_size, os.memory_fill_pattern );
-    if ( block == NULL ) return TaskInvalid;
+    // skipping the fill makes creating a big stack nearly free
+    if ( watermark ) block = os.mem.alloc( stack_size * ZILCH_STACK_SCALE, os.memory_fill_pattern );
+    else block = os.mem.alloc( stack_size * ZILCH_STACK_SCALE );
+    if ( block == NULL ) return invalid_handle;
     stack_frame_t *p = task_create( task, block, arg );
+    if ( p == NULL ) {
+        os.mem.free( block->block );
+        return invalid_handle;
+    }
+    p->watermark = watermark;
     p->state = TaskDestroyable;
     p->address = 0xFFFFFFFF;
     os.num_task = ++num;// total number of tasks
-    return p->state;
+    return p->handle;
+}
+
+task_handle_t Zilch::createFuture( task_result_func_t task, size_t stack_size, void *arg, task_future_t *future, bool watermark ) {
+    // the last task of a reused future has returned and its waiters
+    // were woken, so nothing still points at the old event
+    future->func  = task;
+    future->value = NULL;
+    future->ready = { 0 };
+    task_handle_t handle = createDestroyable( future_run, stack_size, arg, watermark );
+    stack_frame_t *p = task_frame( handle );
+    if ( p != NULL ) p->future = future;
+    // no room for the task, futureWait returns NULL instead of hanging
+    else task_event_set( &future->ready, 1 );
+    return handle;
 }
 
 void Zilch::begin( void ) {
     start_os( );
 }
 
+TaskState Zilch::join( task_handle_t task ) {
+    return task_join( task );
+}
+
+void *Zilch::futureWait( task_future_t *future ) {
+    task_event_wait( &future->ready, 1, false, false );
+    return future->value;
+}
+
+bool Zilch::futureReady( task_future_t *future ) {
+    return future->ready.flags & 1;
+}
+
+TaskState Zilch::state( task_handle_t task ) {
+    TaskState p = task_state( task_frame( task ) );
+    return p;
+}
+
+TaskState Zilch::resume( task_handle_t task ) {
+    TaskState p = task_resume( task_frame( task ) );
+    return p;
+}
+
+TaskState Zilch::pause( task_handle_t task ) {
+    TaskState p = task_pause( task_frame( task ) );
+    return p;
+}
+
+TaskState Zilch::restart( task_handle_t task ) {
+    TaskState p = task_restart( task_frame( task ) );
+    return p;
+}
+
+uint32_t Zilch::freeMemory( task_handle_t task ) {
+    return task_memory( task_frame( task ) );
+}
+
+TaskState Zilch::priority( task_handle_t task, uint8_t level ) {
+    TaskState p = task_priority( task_frame( task ), level );
+    return p;
+}
+
+TaskState Zilch::stats( task_handle_t task, task_stats_t *stats ) {
+    stack_frame_t *p = task_frame( task );
+    *stats = { 0 };
+    if ( p == NULL ) return TaskInvalid;
+#if defined(USE_TASK_STATS)
+    *stats = p->stats;
+#endif
+    return p->state;
+}
+
+void Zilch::traceDump( void ) {
+#if defined(USE_TRACE)
+    // Serial can yield while it drains, hold the ring still till done
+    os.trace_off = true;
+    uint32_t count = os.trace_count;
+    uint32_t n     = count < TRACE_RECORDS ? count : TRACE_RECORDS;
+#if defined(F_CPU)
+    uint32_t hz    = F_CPU;
+#else
+    uint32_t hz    = 0;
+#endif
+    // magic, version, record size, records, clock hz, records ever written
+    uint8_t header[16] = { 'Z', 'T', 'R', 'C', 1, sizeof( task_trace_t ),
+        ( uint8_t )n, ( uint8_t )( n >> 8 ),
+        ( uint8_t )hz, ( uint8_t )( hz >> 8 ), ( uint8_t )( hz >> 16 ), ( uint8_t )( hz >> 24 ),
+        ( uint8_t )count, ( uint8_t )( count >> 8 ), ( uint8_t )( count >> 16 ), ( uint8_t )( count >> 24 ) };
+    Serial.write( header, sizeof( header ) );
+    // oldest first, at most two runs around the end of the ring
+    uint32_t first = ( count - n ) & ( TRACE_RECORDS - 1 );
+    uint32_t run   = n < TRACE_RECORDS - first ? n : TRACE_RECORDS - first;
+    Serial.write( ( const uint8_t * )&os.trace[first], run * sizeof( task_trace_t ) );
+    Serial.write( ( const uint8_t * )os.trace, ( n - run ) * sizeof( task_trace_t ) );
+    os.trace_off = false;
+#endif
+}
+
+void Zilch::traceClear( void ) {
+#if defined(USE_TRACE)
+    os.trace_count = 0;
+#endif
+}
+
+void Zilch::idleStats( task_idle_t *idle ) {
+    *idle = { 0 };
+#if defined(USE_IDLE_SLEEP)
+    idle_account( );
+    *idle = os.idle;
+#endif
+}
+
+void Zilch::resetIdleStats( void ) {
+#if defined(USE_IDLE_SLEEP)
+    os.idle      = { 0 };
+    os.idle_mark = micros( );
+#endif
+}
+
+void Zilch::resetStats( void ) {
+#if defined(USE_TASK_STATS)
+    for ( int i = os.task_map.first( ); i >= 0; i = os.task_map.next( i + 1 ) ) {
+        os.task[i]->stats = { 0 };
+    }
+#endif
+}
+
 TaskState Zilch::state( task_func_t task ) {
-    TaskState p = task_state( task );
+    TaskState p = task_state( find_task( task ) );
     return p;
 }
 
 TaskState Zilch::resume( task_func_t task ) {
-    TaskState p = task_resume( task );
+    TaskState p = task_resume( find_task( task ) );
     return p;
 }
 
 TaskState Zilch::pause( task_func_t task ) {
-    TaskState p = task_pause( task );
+    TaskState p = task_pause( find_task( task ) );
     return p;
 }
 
@@ -155,7 +502,7 @@ void Zilch::sync( void) {
 }
 
 TaskState Zilch::restart( task_func_t task ) {
-    TaskState p = task_restart( task );
+    TaskState p = task_restart( find_task( task ) );
     return p;
 }
 
@@ -168,17 +515,163 @@ void Zilch::restartAll( void ) {
 }
 
 uint32_t Zilch::freeMemory( task_func_t task ) {
-    return task_memory( task );
+    return task_memory( find_task( task ) );
+}
+
+void Zilch::lock( task_mutex_t *mutex ) {
+    task_mutex_lock( mutex );
+}
+
+void Zilch::unlock( task_mutex_t *mutex ) {
+    task_mutex_unlock( mutex );
+}
+
+bool Zilch::tryLock( task_mutex_t *mutex ) {
+    return task_mutex_trylock( mutex );
+}
+
+void Zilch::give( task_sem_t *sem ) {
+    task_sem_give( sem );
+}
+
+void Zilch::take( task_sem_t *sem ) {
+    task_sem_take( sem );
+}
+
+bool Zilch::tryTake( task_sem_t *sem ) {
+    return task_sem_trytake( sem );
+}
+
+void Zilch::setFlags( task_event_t *event, uint32_t flags ) {
+    task_event_set( event, flags );
+}
+
+void Zilch::clearFlags( task_event_t *event, uint32_t flags ) {
+    task_event_clear( event, flags );
+}
+
+uint32_t Zilch::waitFlags( task_event_t *event, uint32_t flags, bool all, bool clear ) {
+    return task_event_wait( event, flags, all, clear );
+}
+
+void Zilch::sleep( uint32_t ms ) {
+    // micros() deadlines wrap after ~71 minutes, sleep long ones in parts
+    while ( ms > 1000000 ) {
+        task_sleep( 1000000000 );
+        ms -= 1000000;
+    }
+    task_sleep( ms * 1000 );
+}
+
+void Zilch::sleepMicroseconds( uint32_t us ) {
+    task_sleep( us );
+}
+
+bool Zilch::timerTask( void ) {
+    if ( os.timer_task != NULL ) return true;
+    task_handle_t handle = create( timer_service, TIMER_STACK_SIZE, NULL );
+    if ( handle.generation == 0 ) return false;
+    os.timer_task = task_frame( handle );
+    task_priority( os.timer_task, TASK_PRIORITY_LEVELS - 1 );
+    return true;
+}
+
+bool Zilch::timerStart( task_timer_t *timer, task_func_t func, void *arg, uint32_t ms, bool reload ) {
+    if ( !timerTask( ) ) return false;
+    timer->func   = func;
+    timer->arg    = arg;
+    timer->reload = reload;
+    task_timer_start( timer, ms * 1000 );
+    return true;
+}
+
+void Zilch::timerStop( task_timer_t *timer ) {
+    task_timer_stop( timer );
+}
+
+void Zilch::timerPeriod( task_timer_t *timer, uint32_t ms ) {
+    if ( timer->active ) task_timer_start( timer, ms * 1000 );
+    else timer->period = ms * 1000;
+}
+
+bool Zilch::timerActive( task_timer_t *timer ) {
+    return timer->active;
+}
+
+bool Zilch::deferBegin( void ) {
+    return timerTask( );
+}
+
+bool Zilch::defer( task_func_t func, void *arg ) {
+    return task_defer( func, arg );
+}
+
+uint32_t Zilch::deferDropped( void ) {
+    return os.defer_dropped;
+}
+
+bool Zilch::poolBegin( task_pool_t *pool, uint8_t workers, size_t stack_size, uint16_t capacity ) {
+    *pool = { 0 };
+    if ( !task_queue_create( &pool->jobs, sizeof( task_job_t ), capacity ) ) return false;
+    // workers already started keep serving the queue if a later one fails
+    while ( workers-- > 0 ) {
+        if ( create( task_pool_worker, stack_size, pool ).generation == 0 ) return false;
+    }
+    return true;
+}
+
+void Zilch::submit( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done ) {
+    task_pool_submit( pool, func, arg, done, true );
+}
+
+bool Zilch::trySubmit( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done ) {
+    return task_pool_submit( pool, func, arg, done, false );
+}
+
+void Zilch::submitBatch( task_pool_t *pool, task_func_t func, void **args, uint16_t n, task_sem_t *done ) {
+    task_pool_batch( pool, func, args, n, done );
+}
+
+void Zilch::poolWait( task_pool_t *pool ) {
+    task_pool_wait( pool );
+}
+
+uint32_t Zilch::poolPending( task_pool_t *pool ) {
+    return pool->pending;
 }
 
 void Zilch::lowMemoryWaterMark( uint16_t threshold ) {
     os.memory_water_mark = threshold;
 }
 
+void Zilch::lowMemoryCallback( task_memory_func_t callback ) {
+    os.low_memory = callback;
+}
+
+uint32_t Zilch::unusedStack( task_handle_t task ) {
+    stack_frame_t *p = task_frame( task );
+    if ( p == NULL || !p->watermark ) return 0;
+    return p->high_water - p->stack_bottom;
+}
+
+uint32_t Zilch::freePoolMemory( void ) {
+    return os.mem.freeWords( );
+}
+
+uint32_t Zilch::largestFreeBlock( void ) {
+    return os.mem.largestFree( );
+}
+
+uint8_t Zilch::fragmentation( void ) {
+    uint32_t free = os.mem.freeWords( );
+    if ( free == 0 ) return 0;
+    return 100 - ( uint64_t )os.mem.largestFree( ) * 100 / free;
+}
+
 void Zilch::printMemoryHeader( void ) {
     Serial.print("Pool Address: ");
-    Serial.println((uint32_t)os.mem.pool, HEX);
-    for ( int i = 0; i < os.mem.poolSize( ); i++ ) {
+    Serial.println((uintptr_t)os.mem.pool, HEX);
+    for ( uint32_t i = 0; i < os.mem.poolSize( ); i++ ) {
         unsigned long mask  = 0x0000000F;
         mask = mask << 28;
         for ( unsigned int n = 8; n > 0; --n ) {
@@ -197,52 +690,145 @@ _|        |________|        |________|        |________|        |________|
 // Tasks startup routine
 //////////////////////////////////////////////////////////////////////
 static void kernal( void *arg ) {
+    int i = -1;
     while ( 1 ) {
-        volatile stack_frame_t *p;
-        for ( p = os.root_frame; p; p = p->next ) {
-            
-            uint32_t top_address       = (uint32_t)p->stack_top;
-            uint32_t bottom_address    = (uint32_t)p->stack_bottom;
-            
-            uint32_t *top       = p->stack_top;
-            uint32_t *bottom    = p->stack_bottom;
-            uint32_t free       = 0;
-            
-            do {
-                if ( *bottom++ == os.memory_fill_pattern ) free++;
-                else break;
-            } while ( top != bottom );
-            p->free_memory = p->sp - p->stack_bottom;
-            if ( free <= os.memory_water_mark ) {
-                Serial.println("Possible Stack Overflow:");
-                Serial.print("memory location:\t");
-                Serial.println((uint32_t)p, HEX);
-                Serial.print("memory free:\t\t");
-                Serial.println(free);
-                Serial.print("memory pressure:\t");
-                Serial.println(p->free_memory);
-                Serial.print("stack top:\t\t");
-                Serial.println(top_address, HEX);
-                Serial.print("stack bottom:\t\t");
-                Serial.println(bottom_address, HEX);
-                Serial.print("return stack:\t\t");
-                Serial.println((uint32_t)p->ptr, HEX);
-                task_pause(p->ptr);
+        // one task per turn, so a lap of the kernal is spread over
+        // as many yields as there are tasks
+        i = os.task_map.next( i + 1 );
+        if ( i >= 0 ) {
+            stack_frame_t *p = os.task[i];
+            if ( p->prev != NULL ) {// only tasks in the run lists
+                p->free_memory = p->sp - p->stack_bottom;
+                if ( p->watermark ) stack_scan( p );
             }
-            if ( p->next == os.root_frame ) break;
         }
         yield();
+#if defined(USE_IDLE_SLEEP)
+        idle_account( );
+        // nothing but the kernal left on the run lists
+        if ( os.ready_map == 1 && os.root_frame->next == os.root_frame ) task_idle( );
+#endif
+    }
+}
+#if defined(USE_IDLE_SLEEP)
+//////////////////////////////////////////////////////////////////////
+// Wait for an interrupt with WFI. Interrupts stay masked from the
+// last check till WFI so a give or setFlags in between just wakes it
+// straight back up, its ISR runs once they are unmasked again.
+//////////////////////////////////////////////////////////////////////
+static void task_idle( void ) {
+    uint32_t primask = irq_save( );
+    if ( os.sem_posted == NULL && os.event_posted == NULL &&
+        ( os.sleep_list == NULL || ( int32_t )( os.sleep_list->wake - micros( ) ) >= IDLE_MIN_US ) ) {
+        uint32_t start = micros( );
+#if defined(__x86_64__)
+        host_wfi( );
+#else
+        asm volatile( "WFI" ::: "memory" );
+#endif
+        os.idle.idle_us += micros( ) - start;
+        os.idle.sleeps++;
+    }
+    irq_restore( primask );
+}
+//////////////////////////////////////////////////////////////////////
+// add the time since the last call to elapsed_us, the kernal calls it
+// every turn so micros() wrapping doesn't lose any.
+//////////////////////////////////////////////////////////////////////
+static void idle_account( void ) {
+    uint32_t now = micros( );
+    os.idle.elapsed_us += now - os.idle_mark;
+    os.idle_mark = now;
+}
+#endif
+//////////////////////////////////////////////////////////////////////
+// Walk a stack's fill pattern down from its high water mark, a few
+// words a turn, wrapping back up once the bottom is reached so words
+// just below the mark are checked most often. Pauses a task that gets
+// within the water mark and tells the low memory callback.
+//////////////////////////////////////////////////////////////////////
+static void stack_scan( stack_frame_t *p ) {
+    uint32_t *bottom = p->stack_bottom;
+#if defined(STACK_GUARD)
+    // stop above the guard, the kernal's own is live while it scans
+    bottom = ( uint32_t * )( ( ( uintptr_t )bottom + 2 * GUARD_BYTES - 1 ) & ~( GUARD_BYTES - 1 ) );
+#endif
+    uint32_t *word = p->scan;
+    for ( uint32_t n = STACK_SCAN_WORDS; n > 0; n-- ) {
+        if ( word <= bottom ) {
+            word = p->high_water;
+            break;
+        }
+        if ( *--word != os.memory_fill_pattern ) p->high_water = word;
     }
+    p->scan = word;
+    
+    uint32_t free = p->high_water - bottom;
+    if ( free <= os.memory_water_mark ) {
+        // pausing a destroyable task frees its frame
+        task_handle_t handle = p->handle;
+        task_pause( p );
+        if ( os.low_memory != NULL ) os.low_memory( handle, free );
+    }
+}
+
+#if defined(STACK_GUARD)
+//////////////////////////////////////////////////////////////////////
+// Stack guard - the Kinetis system MPU grants access if any region
+// does, so the core's access through region 0 is taken away and two
+// regions cover everything below and above the running task's guard.
+// A switch programs the spare pair before dropping the old one so the
+// core never loses access to anything but the guards.
+//////////////////////////////////////////////////////////////////////
+static void guard_init( void ) {
+    // pair 1-2 starts out covering everything, with no guard
+    SYSMPU_RGD( 1, 0 ) = 0;
+    SYSMPU_RGD( 1, 1 ) = 0xFFFFFFFF;
+    SYSMPU_RGD( 1, 2 ) = GUARD_ACCESS;
+    SYSMPU_RGD( 1, 3 ) = 1;
+    os.guard_pair = 0;
+    // region 0 keeps the debugger and DMA masters, not the core
+    SYSMPU_RGDAAC( 0 ) = ( SYSMPU_RGDAAC( 0 ) & ~0x1F ) | 0x18;
+    SYSMPU_CESR = 1;
 }
 
+static void guard_set( volatile stack_frame_t *p ) {
+    uint32_t guard = ( ( uintptr_t )p->stack_bottom + GUARD_BYTES - 1 ) & ~( GUARD_BYTES - 1 );
+    uint32_t next  = 1 + 2 * ( os.guard_pair ^ 1 );
+    uint32_t last  = 1 + 2 * os.guard_pair;
+    SYSMPU_RGD( next, 0 )     = 0;
+    SYSMPU_RGD( next, 1 )     = guard - 1;
+    SYSMPU_RGD( next, 2 )     = GUARD_ACCESS;
+    SYSMPU_RGD( next, 3 )     = 1;
+    SYSMPU_RGD( next + 1, 0 ) = guard + GUARD_BYTES;
+    SYSMPU_RGD( next + 1, 1 ) = 0xFFFFFFFF;
+    SYSMPU_RGD( next + 1, 2 ) = GUARD_ACCESS;
+    SYSMPU_RGD( next + 1, 3 ) = 1;
+    SYSMPU_RGD( last, 3 )     = 0;
+    SYSMPU_RGD( last + 1, 3 ) = 0;
+    os.guard_pair ^= 1;
+}
+#endif
+
+#if defined(KINETISK) || defined(KINETISL)
 void hard_fault_isr( void ) {
+#if defined(STACK_GUARD)
+    if ( SYSMPU_CESR & SYSMPU_SPERR ) {
+        Serial.print( "Stack overflow, task " );
+        Serial.println( os.current_frame->handle.index );
+    }
+#endif
     Serial.print( "os.current_frame: " );
     Serial.print( (uint32_t)os.current_frame->next, HEX );
     Serial.print( " | os.current_frame->next: " );
     Serial.println( (uint32_t)os.current_frame->next->next, HEX );
     uint32_t reg = 0x02;
+    asm volatile( "MRS %[sp], PSP"   "\n" : [sp] "= r" ( reg ): : );
+    Serial.print("task sp: ");
+    Serial.println( reg, HEX );
+    
     asm volatile( "MRS %[sp], MSP"   "\n" : [sp] "= r" ( reg ): : );
-    Serial.print("sp: ");
+    Serial.print("isr sp: ");
     Serial.println( reg, HEX );
     
     asm volatile( "MOV %[r1], r1"   "\n" : [r1] "= r" ( reg ): : );
@@ -295,20 +881,47 @@ void hard_fault_isr( void ) {
     
     while ( 1 ) if ( SIM_SCGC4 & SIM_SCGC4_USBOTG ) usb_isr( );
 }
+#endif
 
 void start_os( void ) {
-    if ( os.num_task <= 0 ) return;             // if no task return
+    if ( os.root_frame == NULL ) return;        // if no task return
     os.current_frame = os.root_frame;           // current frame starts as root
     void *arg = os.root_frame->arg;             // get root frame's arg
-    stack_frame_t *p = os.current_frame->next;  // p point to the next frame in the list
+    os.ready[0] = os.root_frame->next;          // root's level carries on after it
     os.begin = true;                            // allow context switch
+#if defined(TASK_CYCLES)
+#if defined(KINETISK)
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+#endif
+#if defined(USE_TASK_STATS)
+    os.run_start = task_cycles( );
+#endif
+#if defined(USE_IDLE_SLEEP)
+    os.idle_mark = micros( );
+#endif
+#if defined(__x86_64__)
+    // host kernal runs on its own pool stack, swap in through task_start.
+    stack_frame_t boot;
+    task_swap( &boot, os.current_frame );
+#else
     __disable_irq( );
-    // kernal uses msp and all tasks use the psp stack pointer.
+#if defined(STACK_GUARD)
+    guard_init( );
+    guard_set( os.root_frame );
+#endif
+    // every task runs on the psp, the msp stays on the startup stack
+    // and from here on only takes interrupts, so no task stack has to
+    // leave room for the deepest ISR nesting.
+    uint32_t reg = 0x02;
     asm volatile(
-                 "MSR MSP, %[kernal]"     "\n"
-                 :
-                 : [kernal] "r" ( os.current_frame->sp )
+                 "MSR PSP, %[kernal]"     "\n\t"
+                 "MSR CONTROL, %[psp]"    "\n\t"
+                 "ISB"                    "\n"
                  :
+                 : [kernal] "r" ( os.current_frame->sp ), [psp] "r" ( reg )
+                 : "memory"
                  );
     /*asm volatile(
                  "MSR MSP, %[kernal]"     "\n\t"
@@ -322,6 +935,7 @@ void start_os( void ) {
     os.root_frame->ptr( arg );          // call first frame's function, starts scheduler
     os.root_frame->state = TaskInvalid; // update state, after return.
     for (;;) yield( );                  // keep things rolling
+#endif
 }
 //////////////////////////////////////////////////////////////////////
 // Initialize main stack
@@ -333,10 +947,53 @@ void init_stack( uint32_t memory_fill ) {
     os.current_frame       = NULL;        // context switch frame pointer
     os.root_frame          = NULL;        // kernal frame pointer
     os.tasks_to_destroy    = false;
+    os.generation          = 0;           // last handle generation
+    os.task_map.reset( );                 // task table is empty
+    os.sleep_list          = NULL;        // no sleeping tasks
+    os.timer_list          = NULL;        // no software timers running
+    os.timer_task          = NULL;        // timer task made on first use
+    os.defer_read          = 0;           // deferred work queue is empty
+    os.defer_write         = 0;
+    os.defer_dropped       = 0;
+    os.ready_map           = 0;           // all ready lists empty
+    os.sem_posted          = NULL;        // nothing given from an ISR yet
+    os.event_posted        = NULL;
 }
 //////////////////////////////////////////////////////////////////////
 // Task's launch pad
 //////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__)
+// r12 holds the stack frame on entry, same as the Cortex-M launch pad.
+asm (
+     ".pushsection .text"           "\n\t"
+     ".globl task_start"            "\n\t"
+     ".type task_start, @function"  "\n"
+     "task_start:"                  "\n\t"
+     "movq %r12, %rdi"              "\n\t"// rdi now holds the stack frame
+     "andq $-16, %rsp"              "\n\t"// abi wants 16 byte aligned calls
+     "call task_run"                "\n\t"
+     "ud2"                          "\n\t"// task_run never returns
+     ".popsection"                  "\n"
+     );
+
+void task_run( stack_frame_t *p ) {
+    p->ptr( p->arg );
+    task_joined( p );
+    TRACE( TraceReturn, p, NULL );
+    // task is returned remove it from linked list
+    p = remove_task_from_runlist( p );
+    // if p == NULL task and memory are removed
+    if ( p != NULL ) p->state = TaskReturned;
+    // task stops here with a call to yield
+    yield( );
+}
+#else
+// the switch saves sp, r4-r12 and lr as the first 11 words of the
+// frame and task_start loads ptr and arg at fixed offsets
+static_assert( offsetof( stack_frame_t, r12 ) == 36 && offsetof( stack_frame_t, lr ) == 40,
+              "task_swap depends on the Cortex-M stack_frame_t layout" );
+static_assert( offsetof( stack_frame_t, ptr ) == 60 && offsetof( stack_frame_t, arg ) == 64,
+              "task_start depends on the Cortex-M stack_frame_t layout" );
 static void task_start( void ) __attribute__((naked));
 static void task_start( void ) {
     volatile stack_frame_t *p;
@@ -353,17 +1010,23 @@ static void task_start( void ) {
                  :
                  : "r0", "r1", "r2", "r3", "r4", "r12", "memory"
                  );
+    task_joined( ( stack_frame_t * )p );
+    TRACE( TraceReturn, p, NULL );
     // task is returned remove it from linked list
-    p = remove_task_from_runlist2( p );
+    p = remove_task_from_runlist( p );
     // if p == NULL task and memory are removed
     if ( p != NULL ) p->state = TaskReturned;
     // task stops here with a call to yield
     yield( );
 }
+#endif
 //////////////////////////////////////////////////////////////////////
-// Set up a task to execute, will launch when yield switches in
+// Set up a task to execute, will launch when yield switches in,
+// returns NULL when the task table is full.
 //////////////////////////////////////////////////////////////////////
 stack_frame_t *task_create( task_func_t func, mem_block_t *block, void *arg ) {
+    int index = os.task_map.firstClear( );
+    if ( index < 0 ) return NULL;
     uint32_t frame_size  = ( sizeof( stack_frame_t ) ) >> 2;// size of struct in words
     uint32_t address = os.num_task;                         // each task has unique address
     uint32_t stack_size = block->length - frame_size;
@@ -377,10 +1040,17 @@ stack_frame_t *task_create( task_func_t func, mem_block_t *block, void *arg ) {
     p->address      = address;
     p->stack_top    = ( uint32_t * )stack + stack_size + frame_size - 1;
     p->stack_bottom = ( uint32_t * )stack + frame_size;
+    p->high_water   = p->stack_top;
+    p->scan         = p->stack_top;
     p->ptr          = func;
     p->arg          = arg;
     p->state        = TaskCreated;
-    add_task_to_runlist( p->ptr );
+    if ( ++os.generation == 0 ) os.generation = 1;
+    p->handle.index      = index;
+    p->handle.generation = os.generation;
+    os.task[index]  = p;
+    os.task_map.set( index );
+    ready_insert( p );
     return p;
 }
 //////////////////////////////////////////////////////////////////////
@@ -412,15 +1082,106 @@ void task_swap( stack_frame_t *prevframe, stack_frame_t *nextframe ) {
                   "MSR PSP, r3"         "\n"   // move r3 into sp
                   );
 }
+#elif defined(KINETISK)
+// Naked so no compiler prologue or epilogue runs around the switch. A
+// new frame's lr is task_start with sp at stack_top, an epilogue in
+// yield would pop the caller's registers off a stack that has none.
+static void task_swap( volatile stack_frame_t *prevframe, volatile stack_frame_t *nextframe ) __attribute__((naked, noinline));
+static void task_swap( volatile stack_frame_t *prevframe, volatile stack_frame_t *nextframe ) {
+    asm volatile (
+#if defined(TASK_FPU)
+                  "LDRB r2, [r0, %[fpu]]"   "\n\t" // prevframe uses the FPU?
+                  "CBZ r2, 1f"              "\n\t"
+                  "VPUSH {s16-s31}"         "\n\t" // Save s16-s31 on its stack
+                  "1:"                      "\n\t"
+#endif
+                  "MRS r3, PSP"             "\n\t" // move psp into r3
+                  "STMIA r0,{r3-r12, lr}"   "\n\t" // Save r3-r12 + lr
+                  "LDMIA r1,{r3-r12, lr}"   "\n\t" // Restore r1(sp) and r4-r12, lr
+                  "MSR PSP, r3"             "\n\t" // Set new psp
+#if defined(TASK_FPU)
+                  "LDRB r2, [r1, %[fpu]]"   "\n\t" // nextframe uses the FPU?
+                  "CBZ r2, 2f"              "\n\t"
+                  "VPOP {s16-s31}"          "\n\t" // Restore s16-s31 from its stack
+                  "2:"                      "\n\t"
+                  "MRS r2, CONTROL"         "\n\t" // clear FPCA so the next
+                  "BIC r2, r2, #4"          "\n\t" // FPU use shows up again
+                  "MSR CONTROL, r2"         "\n\t"
+                  "ISB"                     "\n\t"
+#endif
+                  "BX lr"                   "\n"   // into yield, or task_start
+                  :
+                  : [fpu] "i" ( offsetof( stack_frame_t, fpu ) )
+                  );
+}
+#elif defined(__x86_64__)
+static_assert( offsetof( stack_frame_t, r12 ) == 48 && offsetof( stack_frame_t, lr ) == 56,
+              "task_swap depends on the host stack_frame_t layout" );
+// rdi holds prevframe, rsi holds nextframe
+asm (
+     ".pushsection .text"           "\n\t"
+     ".globl task_swap"             "\n\t"
+     ".type task_swap, @function"   "\n"
+     "task_swap:"                   "\n\t"
+     "movq (%rsp), %rax"            "\n\t"// return address becomes lr
+     "leaq 8(%rsp), %rcx"           "\n\t"// sp as the caller sees it
+     "movq %rcx,  0(%rdi)"          "\n\t"// Save sp, rbx, rbp, r13-r15, r12, lr
+     "movq %rbx,  8(%rdi)"          "\n\t"
+     "movq %rbp, 16(%rdi)"          "\n\t"
+     "movq %r13, 24(%rdi)"          "\n\t"
+     "movq %r14, 32(%rdi)"          "\n\t"
+     "movq %r15, 40(%rdi)"          "\n\t"
+     "movq %r12, 48(%rdi)"          "\n\t"
+     "movq %rax, 56(%rdi)"          "\n\t"
+     "movq  0(%rsi), %rsp"          "\n\t"// Restore sp, rbx, rbp, r13-r15, r12
+     "movq  8(%rsi), %rbx"          "\n\t"
+     "movq 16(%rsi), %rbp"          "\n\t"
+     "movq 24(%rsi), %r13"          "\n\t"
+     "movq 32(%rsi), %r14"          "\n\t"
+     "movq 40(%rsi), %r15"          "\n\t"
+     "movq 48(%rsi), %r12"          "\n\t"
+     "jmpq *56(%rsi)"               "\n\t"// jump to lr
+     ".popsection"                  "\n"
+     );
 #endif
 
 void yield( void ) __attribute__((noinline));
 void yield( void ) {
     
     if ( !os.begin ) return;
+#if defined(KINETISK) || defined(KINETISL)
+    // an ISR runs on the msp, it can't switch the task out from under itself
+    uint32_t ipsr;
+    asm volatile( "MRS %[ipsr], IPSR" : [ipsr] "=r" ( ipsr ) );
+    if ( ipsr ) return;
+#endif
+    
+#if defined(USE_TASK_STATS)
+    // the stretch since the last yield goes to whoever ran it
+    uint32_t now = task_cycles( );
+    uint32_t run = now - os.run_start;
+    os.run_start = now;
+    os.current_frame->stats.run_cycles += run;
+    if ( run > os.current_frame->stats.longest_run ) os.current_frame->stats.longest_run = run;
+#endif
     
+    if ( os.sleep_list != NULL ) task_wake( );
+    if ( os.sem_posted != NULL || os.event_posted != NULL ) task_posted( );
+    
+    // highest non empty level, round robin inside it
+    uint32_t level = 31 - __builtin_clz( os.ready_map );
     volatile stack_frame_t *p1 = os.current_frame;
-    volatile stack_frame_t *p2 = os.current_frame->next;
+    volatile stack_frame_t *p2 = os.ready[level];
+    os.ready[level]   = p2->next;
+    if ( p1 == p2 ) return;
+    if ( p2->refill ) task_refill( ( stack_frame_t * )p2 );
+#if defined(STACK_GUARD)
+    guard_set( p2 );
+#endif
+#if defined(USE_TASK_STATS)
+    p2->stats.switches++;
+#endif
+    TRACE( p2->lr == ( uint32_t * )task_start ? TraceStart : TraceSwitch, p1, p2 );
     os.current_frame  = p2;
     /*uint32_t fOut = p1->address;
     uint32_t fIn  = p2->address;
@@ -510,51 +1271,22 @@ void yield( void ) {
                       );
     }*/
     
-#if defined(KINETISK)
-    asm volatile (
-                  "MOV r0, %[frameOut]"     "\n\t" // r0 holds p1
-                  "MRS r3, MSP"             "\n\t" // move sp into r3
-                  "STMIA r0,{r3-r12, lr}"   "\n\t" // Save r3-r12 + lr
-                  "MOV r1, %[frameIn]"      "\n\t" // r1 holds p2
-                  "LDMIA r1,{r3-r12, lr}"   "\n\t" // Restore r1(sp) and r4-r12, lr
-                  "MSR MSP, r3"             "\n"   // Set new sp
-                  : [frameOut] "+r" ( p1 )
-                  : [frameIn] "r" ( p2 )
-                  : "r3"
-                  ) ;
-
-    /*asm volatile (
-                  "MOV r1, %[begin]"                "\n\t" // r0 holds p1
-                  "cbz r1, end"                     "\n\t" // r0 holds p1
-                  "MOV r0, %[frameOut]"             "\n\t" // r0 holds p1
-                  "MRS r3, MSP"                     "\n\t" // move sp into r3
-                  "STMIA r0,{r3-r12, lr}"           "\n\t" // Save r3-r12 + lr
-                  "MOV r1, %[frameIn]"              "\n\t" // r1 holds p2
-                  "LDMIA r1,{r3-r12, lr}"           "\n\t" // Restore r1(sp) and r4-r12, lr
-                  "MSR MSP, r3"                     "\n\t"   // Set new sp
-                  "MOV %[frameOut], %[frameIn]"     "\n\t"
-                  "end:"                            "\n" // r0 holds p1
-                  : [frameOut] "+r" ( os.current_frame )
-                  : [frameIn] "r" ( os.current_frame->next ), [begin] "r" ( os.begin )
-                  );*/
-    
-#elif defined(KINETISL)
-    task_swap( p1, p2 );
+#if defined(TASK_FPU)
+    // CONTROL.FPCA is set by the first FPU instruction since p1 was
+    // switched in. Once a task has used the FPU its s16-s31 go on its
+    // stack at every switch, integer only tasks never pay for it.
+    uint32_t control;
+    asm volatile ( "MRS %[control], CONTROL" : [control] "=r" ( control ) );
+    if ( control & 0x04 ) p1->fpu = true;
 #endif
+    task_swap( p1, p2 );
 }
 //////////////////////////////////////////////////////////////////////
 // pass task state, pass loop state
 //////////////////////////////////////////////////////////////////////
-TaskState task_state( task_func_t func ) {
-    mem_block_t *start = os.mem.allocList( );
-    mem_block_t *end = start + 31;
-    do {
-        if ( start->block != 0 ) {
-            stack_frame_t *p = ( stack_frame_t * )start->block;
-            if ( p->ptr == func ) return p->state;
-        }
-    } while ( ++start != end );
-    return TaskInvalid;
+TaskState task_state( stack_frame_t *p ) {
+    if ( p == NULL ) return TaskInvalid;
+    return p->state;
 }
 //////////////////////////////////////////////////////////////////////
 // routine to block until selected task return's.
@@ -575,15 +1307,67 @@ void task_sync( void ) {
     }*/
 }
 //////////////////////////////////////////////////////////////////////
+// park the current task until the handle's task returns, or spin for
+// the kernal and code running before begin. A destroyable task's
+// handle goes stale when it returns, which counts as returned too.
+//////////////////////////////////////////////////////////////////////
+TaskState task_join( task_handle_t handle ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    stack_frame_t *t = task_frame( handle );
+    if ( t == NULL ) return TaskInvalid;
+    if ( t == p ) return t->state;// would never wake
+    while ( t != NULL && t->state != TaskReturned ) {
+        if ( !os.begin || p == os.root_frame ) {
+            yield( );
+        } else {
+            // a task resumed early is still queued and just parks again
+            if ( p->wait_on != t ) {
+                p->wait_on   = t;
+                p->wait_kind = WaitJoin;
+                p->wait_next = t->joiners;
+                t->joiners   = p;
+            }
+            ready_remove( p );
+            yield( );
+        }
+        t = task_frame( handle );
+    }
+    return TaskReturned;
+}
+//////////////////////////////////////////////////////////////////////
+// the task's function returned, wake its joiners in the order they
+// joined and mark its future ready.
+//////////////////////////////////////////////////////////////////////
+void task_joined( stack_frame_t *p ) {
+    stack_frame_t *woke = p->joiners;
+    p->joiners = NULL;
+    for ( stack_frame_t *w = woke; w != NULL; w = w->wait_next ) w->wait_on = NULL;
+    wait_push( woke );
+    if ( p->future != NULL ) task_event_set( &p->future->ready, 1 );
+}
+//////////////////////////////////////////////////////////////////////
+// createFuture's task function, runs the real one and keeps what it
+// returns in the future.
+//////////////////////////////////////////////////////////////////////
+static void future_run( void *arg ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    p->future->value = p->future->func( arg );
+}
+//////////////////////////////////////////////////////////////////////
 // restart a task or restart up returned task
 //////////////////////////////////////////////////////////////////////
-TaskState task_restart( task_func_t func ) {
-    stack_frame_t *p = add_task_to_runlist( func );
+TaskState task_restart( stack_frame_t *p ) {
     if ( p != NULL ) {
+        timer_remove( p );
+        wait_cancel( p );
+        mutex_release_all( p );
+        ready_insert( p );
         p->state    = TaskCreated;
         p->sp       = p->stack_top;
         p->r12      = ( uint32_t * )p;
         p->lr       = ( uint32_t * )task_start;
+        p->refill   = p->watermark;
+        p->fpu      = false;
         return p->state;
     }
     return TaskInvalid;
@@ -593,7 +1377,7 @@ TaskState task_restart( task_func_t func ) {
 //////////////////////////////////////////////////////////////////////
 TaskState task_stop( task_func_t func ) {
     mem_block_t *start = os.mem.allocList( );
-    mem_block_t *end = start + 31;
+    mem_block_t *end = start + MEM_MAX_BLOCKS;
     do {
         if ( start->block != 0 ) {
             stack_frame_t *p = ( stack_frame_t * )start->block;
@@ -604,109 +1388,849 @@ TaskState task_stop( task_func_t func ) {
 // restart all tasks
 //////////////////////////////////////////////////////////////////////
 void task_restart_all( void ) {
-    mem_block_t *start = os.mem.allocList( );
-    mem_block_t *end = start + 31;
-    do {
-        if ( start->block != 0 ) {
-            stack_frame_t *p = ( stack_frame_t * )start->block;
-            add_task_to_runlist( p->ptr );
-            p->state = TaskCreated;
-            p->sp    = p->stack_top;
-            p->r12   = ( uint32_t * )p;
-            p->lr    = ( uint32_t * )task_start;
-        }
-    } while ( ++start != end );
+    while ( os.sleep_list != NULL ) timer_remove( os.sleep_list );
+    for ( int i = os.task_map.first( ); i >= 0; i = os.task_map.next( i + 1 ) ) {
+        stack_frame_t *p = os.task[i];
+        wait_cancel( p );
+        mutex_release_all( p );
+        ready_insert( p );
+        p->state = TaskCreated;
+        p->sp    = p->stack_top;
+        p->r12   = ( uint32_t * )p;
+        p->lr    = ( uint32_t * )task_start;
+        p->refill = p->watermark;
+        p->fpu    = false;
+    }
 }
 //////////////////////////////////////////////////////////////////////
-// pause running task
+// pause running task, it leaves any queue it waits in but keeps the
+// mutexes it holds so it can finish its critical section once resumed.
 //////////////////////////////////////////////////////////////////////
-TaskState task_pause( task_func_t func ) {
-    stack_frame_t *p = remove_task_from_runlist( func );
+TaskState task_pause( stack_frame_t *p ) {
+    if ( p == NULL ) return TaskInvalid;
+    // a sleeping or waiting task is off the run list but still pausable
+    boolean parked = timer_remove( p ) || p->wait_on != NULL;
+    if ( p->prev == NULL && !parked ) return TaskInvalid;
+    wait_cancel( p );
+    p = remove_task_from_runlist( p );
     if ( p == NULL ) return TaskInvalid;
     p->state = TaskPaused;
+    TRACE( TracePause, os.current_frame, p );
     return p->state;
 }
 //////////////////////////////////////////////////////////////////////
 // start paused task
 //////////////////////////////////////////////////////////////////////
-TaskState task_resume( task_func_t func ) {
-    stack_frame_t *p = add_task_to_runlist( func );
+TaskState task_resume( stack_frame_t *p ) {
     if ( p == NULL ) return TaskInvalid;
+    // resuming a sleeping task wakes it early, its deadline becomes now
+    timer_remove( p );
+    p->wake = micros( );
+    ready_insert( p );
     p->state = TaskCreated;
+    TRACE( TraceResume, os.current_frame, p );
     return p->state;
 }
 //////////////////////////////////////////////////////////////////////
 // return task unused memory, only returns active tasks memory
 //////////////////////////////////////////////////////////////////////
-uint32_t task_memory( task_func_t func ) {
-    stack_frame_t *p;
-    for ( p = os.root_frame; p; p = p->next ) {
-        if ( p->ptr == func ) return p->free_memory;
-        if ( p->next == os.root_frame ) return 0;
+uint32_t task_memory( stack_frame_t *p ) {
+    if ( p == NULL || p->prev == NULL ) return 0;
+    return p->free_memory;
+}
+//////////////////////////////////////////////////////////////////////
+// fill a restarted task's stack again so its watermark starts over,
+// done by yield before switching in. Only below the saved sp, a task
+// that restarted itself is still using what is above it.
+//////////////////////////////////////////////////////////////////////
+void task_refill( stack_frame_t *p ) {
+    os.mem.fill( p->stack_bottom, p->sp - p->stack_bottom, os.memory_fill_pattern );
+    p->high_water = p->sp;
+    p->scan       = p->sp;
+    p->refill     = false;
+}
+//////////////////////////////////////////////////////////////////////
+// handle to frame, NULL if the slot was freed or reused since
+//////////////////////////////////////////////////////////////////////
+stack_frame_t *task_frame( task_handle_t handle ) {
+    if ( handle.index >= TASK_TABLE_SIZE ) return NULL;
+    stack_frame_t *p = os.task[handle.index];
+    if ( p == NULL || p->handle.generation != handle.generation ) return NULL;
+    return p;
+}
+//////////////////////////////////////////////////////////////////////
+// find a task's frame in the task table by function
+//////////////////////////////////////////////////////////////////////
+stack_frame_t *find_task( task_func_t func ) {
+    for ( int i = os.task_map.first( ); i >= 0; i = os.task_map.next( i + 1 ) ) {
+        stack_frame_t *p = os.task[i];
+        if ( p->ptr == func ) return p;
+    }
+    return NULL;
+}
+//////////////////////////////////////////////////////////////////////
+// link a frame into its level's run list, it runs last in that
+// level's current lap.
+//////////////////////////////////////////////////////////////////////
+void ready_insert( stack_frame_t *p ) {
+    if ( p->prev != NULL ) return;
+    uint8_t level = p->priority;
+    stack_frame_t *at = os.ready[level];
+    if ( at == NULL ) {
+        p->next = p;
+        p->prev = p;
+        os.ready[level] = p;
+        os.ready_map |= 1UL << level;
+        return;
+    }
+    p->next = at;
+    p->prev = at->prev;
+    at->prev->next = p;
+    at->prev = p;
+}
+//////////////////////////////////////////////////////////////////////
+// link a frame into its level's run list, it runs next in that level
+//////////////////////////////////////////////////////////////////////
+void ready_push( stack_frame_t *p ) {
+    ready_insert( p );
+    os.ready[p->priority] = p;
+}
+//////////////////////////////////////////////////////////////////////
+// unlink a frame from its run list, the kernal never leaves
+//////////////////////////////////////////////////////////////////////
+void ready_remove( stack_frame_t *p ) {
+    if ( p->prev == NULL || p == os.root_frame ) return;
+    uint8_t level = p->priority;
+    if ( p->next == p ) {
+        os.ready[level] = NULL;
+        os.ready_map &= ~( 1UL << level );
+    } else {
+        if ( os.ready[level] == p ) os.ready[level] = p->next;
+        p->prev->next = p->next;
+        p->next->prev = p->prev;
+    }
+    p->prev = NULL;
+}
+//////////////////////////////////////////////////////////////////////
+// set a task's priority, a level lent by a mutex waiter is kept
+//////////////////////////////////////////////////////////////////////
+TaskState task_priority( stack_frame_t *p, uint8_t level ) {
+    if ( p == NULL || level >= TASK_PRIORITY_LEVELS ) return TaskInvalid;
+    if ( p == os.root_frame ) return p->state;// kernal stays lowest
+    uint8_t lent = p->priority > p->base_priority ? p->priority : 0;
+    p->base_priority = level;
+    ready_level( p, level > lent ? level : lent );
+    return p->state;
+}
+//////////////////////////////////////////////////////////////////////
+// move a task to another ready level
+//////////////////////////////////////////////////////////////////////
+void ready_level( stack_frame_t *p, uint8_t level ) {
+    if ( p->priority == level ) return;
+    if ( p->prev != NULL ) {
+        ready_remove( p );
+        p->priority = level;
+        ready_insert( p );
+    } else {
+        p->priority = level;
     }
-    return 0;
 }
 //////////////////////////////////////////////////////////////////////
 // remove task from the run list
 //////////////////////////////////////////////////////////////////////
-stack_frame_t *remove_task_from_runlist2( volatile stack_frame_t *frame ) {
-    stack_frame_t *p, *prev;
-    prev = os.root_frame;
-    for ( p = os.root_frame; p; p = p->next ) {
-        if ( p == frame ) {
-            prev->next = p->next;
-            if ( p->state == TaskDestroyable ) {
-                os.mem.free( ( uint32_t * )p );
-                os.mem.combine_free_blocks( );
-                return NULL;
+stack_frame_t *remove_task_from_runlist( volatile stack_frame_t *frame ) {
+    stack_frame_t *p = ( stack_frame_t * )frame;
+    ready_remove( p );
+    if ( p->state == TaskDestroyable ) {
+        // paused before it returned, nothing may point at the frame once
+        // it is freed. After a return task_joined finds nothing left to do.
+        wait_cancel( p );
+        mutex_release_all( p );
+        task_joined( p );
+        TRACE( TraceDestroy, p, NULL );
+        os.task[p->handle.index] = NULL;
+        os.task_map.clear( p->handle.index );
+        os.mem.free( ( uint32_t * )p );
+        return NULL;
+    }
+    return p;
+}
+//////////////////////////////////////////////////////////////////////
+// park the current task until 'us' from now, the kernal and code
+// running before begin can't leave the run list so they spin instead.
+//////////////////////////////////////////////////////////////////////
+void task_sleep( uint32_t us ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    uint32_t wake = micros( ) + us;
+    if ( !os.begin || p == os.root_frame ) {
+        while ( ( int32_t )( micros( ) - wake ) < 0 ) yield( );
+        return;
+    }
+    // only a resume moves the deadline, any other early wake parks again
+    p->wake = wake;
+    while ( ( int32_t )( micros( ) - p->wake ) < 0 ) {
+        timer_insert( p );
+        ready_remove( p );
+        yield( );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// move expired sleepers back to the run list, they run next in order
+// of their deadlines.
+//////////////////////////////////////////////////////////////////////
+void task_wake( void ) {
+    uint32_t now = micros( );
+    stack_frame_t *woke = NULL;
+    stack_frame_t *p    = os.sleep_list;
+    while ( p != NULL && ( int32_t )( now - p->wake ) >= 0 ) {
+        os.sleep_list = p->wake_next;
+        p->sleeping   = false;
+        p->wake_next  = woke;
+        woke = p;
+        p = os.sleep_list;
+    }
+    // latest deadline first, pushing each in front leaves them in order
+    while ( woke != NULL ) {
+        p = woke->wake_next;
+        ready_push( woke );
+        woke = p;
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// (re)start a software timer, it first runs 'us' from now
+//////////////////////////////////////////////////////////////////////
+void task_timer_start( task_timer_t *timer, uint32_t us ) {
+    task_timer_stop( timer );
+    timer->period = us;
+    timer_arm( timer, micros( ) + us );
+}
+//////////////////////////////////////////////////////////////////////
+// add a timer to the timer list, sorted by deadline
+//////////////////////////////////////////////////////////////////////
+void timer_arm( task_timer_t *timer, uint32_t wake ) {
+    timer->wake = wake;
+    task_timer_t **link = &os.timer_list;
+    while ( *link != NULL && ( int32_t )( ( *link )->wake - timer->wake ) <= 0 ) {
+        link = &( *link )->next;
+    }
+    timer->next   = *link;
+    timer->active = true;
+    *link = timer;
+    if ( os.timer_list == timer ) timer_schedule( );
+}
+//////////////////////////////////////////////////////////////////////
+// take a software timer off the timer list, the timer task may wake
+// for nothing and goes back to sleep.
+//////////////////////////////////////////////////////////////////////
+void task_timer_stop( task_timer_t *timer ) {
+    if ( !timer->active ) return;
+    task_timer_t **link = &os.timer_list;
+    while ( *link != timer ) link = &( *link )->next;
+    *link = timer->next;
+    timer->active = false;
+}
+//////////////////////////////////////////////////////////////////////
+// a parked timer task sleeps till the earliest timer instead, when
+// it is running or ready it looks at the list again itself. So does a
+// callback parked in sleep or a wait, only the idle wait on the defer
+// event is cut short.
+//////////////////////////////////////////////////////////////////////
+void timer_schedule( void ) {
+    stack_frame_t *p = os.timer_task;
+    if ( p == NULL || p->prev != NULL || p->state == TaskPaused ) return;
+    if ( p->wait_on != &os.defer_event ) return;
+    p->wake = os.timer_list->wake;
+    timer_insert( p );
+}
+//////////////////////////////////////////////////////////////////////
+// queue func(arg) for the timer task, ISR safe. Returns 0 when the
+// queue is full or there is no timer task to run it.
+//////////////////////////////////////////////////////////////////////
+uint32_t task_defer( task_func_t func, void *arg ) {
+    if ( os.timer_task == NULL ) return 0;
+    uint32_t primask = irq_save( );
+    uint16_t write = os.defer_write;
+    if ( ( uint16_t )( write - os.defer_read ) == DEFER_QUEUE_SIZE ) {
+        os.defer_dropped++;
+        irq_restore( primask );
+        return 0;
+    }
+    task_defer_t *job = &os.defer[write & ( DEFER_QUEUE_SIZE - 1 )];
+    job->func = func;
+    job->arg  = arg;
+    os.defer_write = write + 1;
+    irq_restore( primask );
+    task_event_set( &os.defer_event, 1 );
+    return 1;
+}
+//////////////////////////////////////////////////////////////////////
+// take the oldest deferred item, false when there is none
+//////////////////////////////////////////////////////////////////////
+static bool defer_pop( task_defer_t *job ) {
+    uint32_t primask = irq_save( );
+    uint16_t read = os.defer_read;
+    bool any = read != os.defer_write;
+    if ( any ) {
+        *job = os.defer[read & ( DEFER_QUEUE_SIZE - 1 )];
+        os.defer_read = read + 1;
+    }
+    irq_restore( primask );
+    return any;
+}
+//////////////////////////////////////////////////////////////////////
+// queue the timer task on the defer event unless work is already
+// pending, interrupts are masked so a defer can't slip in between.
+//////////////////////////////////////////////////////////////////////
+static bool defer_wait( stack_frame_t *p ) {
+    uint32_t primask = irq_save( );
+    bool wait = os.defer_read == os.defer_write;
+    if ( wait ) {
+        p->wait_on    = &os.defer_event;
+        p->wait_kind  = WaitEvent;
+        p->wait_flags = 1;
+        p->wait_all   = false;
+        p->wait_next  = NULL;
+        os.defer_event.head = p;
+        os.defer_event.tail = p;
+    }
+    irq_restore( primask );
+    return wait;
+}
+//////////////////////////////////////////////////////////////////////
+// a timer woke the timer task first, stop waiting on the defer event
+//////////////////////////////////////////////////////////////////////
+static void defer_unwait( stack_frame_t *p ) {
+    uint32_t primask = irq_save( );
+    if ( p->wait_on == &os.defer_event ) {
+        os.defer_event.head = NULL;
+        os.defer_event.tail = NULL;
+        p->wait_on = NULL;
+    }
+    irq_restore( primask );
+}
+//////////////////////////////////////////////////////////////////////
+// Timer task, drains the deferred work queue then runs the timer
+// callbacks that are due in deadline order, going back to the queue
+// between each. Then it sleeps till the next timer and waits on the
+// defer event at once, whichever comes first wakes it. A reloaded
+// timer that fell more than a period behind skips the runs it missed
+// instead of firing them back to back.
+//////////////////////////////////////////////////////////////////////
+static void timer_service( void *arg ) {
+    stack_frame_t *self = ( stack_frame_t * )os.current_frame;
+    while ( 1 ) {
+        timer_remove( self );
+        defer_unwait( self );
+        task_event_clear( &os.defer_event, 1 );
+        task_defer_t job;
+        while ( defer_pop( &job ) ) job.func( job.arg );
+        
+        task_timer_t *t = os.timer_list;
+        uint32_t now = micros( );
+        if ( t == NULL || ( int32_t )( now - t->wake ) < 0 ) {
+            if ( t != NULL ) {
+                self->wake = t->wake;
+                timer_insert( self );
             }
-            return p;
+            if ( defer_wait( self ) ) {
+                ready_remove( self );
+                yield( );
+            }
+            continue;
+        }
+        os.timer_list = t->next;
+        t->active = false;
+        if ( t->reload ) {
+            uint32_t wake = t->wake + t->period;
+            if ( ( int32_t )( now - wake ) >= 0 ) wake = now + t->period;
+            timer_arm( t, wake );
         }
-        prev = p;
-        if ( p->next == os.root_frame ) break;
+        t->func( t->arg );
     }
-    return NULL;
 }
-
-stack_frame_t *remove_task_from_runlist( task_func_t func ) {
-    stack_frame_t *p, *prev;
-    prev = os.root_frame;
-    for ( p = os.root_frame; p; p = p->next ) {
-        if ( p->ptr == func ) {
-            prev->next = p->next;
-            if ( p->state == TaskDestroyable ) {
-                os.mem.free( ( uint32_t * )p );
-                os.mem.combine_free_blocks( );
-                return NULL;
-            }
-            return p;
+//////////////////////////////////////////////////////////////////////
+// add a frame to the sleep list, sorted by deadline
+//////////////////////////////////////////////////////////////////////
+void timer_insert( stack_frame_t *p ) {
+    timer_remove( p );
+    stack_frame_t **link = &os.sleep_list;
+    while ( *link != NULL && ( int32_t )( ( *link )->wake - p->wake ) <= 0 ) {
+        link = &( *link )->wake_next;
+    }
+    p->wake_next = *link;
+    p->sleeping  = true;
+    *link = p;
+}
+//////////////////////////////////////////////////////////////////////
+// take a frame off the sleep list, returns true if it was sleeping
+//////////////////////////////////////////////////////////////////////
+boolean timer_remove( stack_frame_t *p ) {
+    if ( !p->sleeping ) return false;
+    stack_frame_t **link = &os.sleep_list;
+    while ( *link != p ) link = &( *link )->wake_next;
+    *link = p->wake_next;
+    p->sleeping = false;
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+// make 'p' the owner and keep the mutex on its owned list
+//////////////////////////////////////////////////////////////////////
+static void mutex_own( task_mutex_t *mutex, stack_frame_t *p ) {
+    mutex->owner      = p;
+    mutex->owned_next = p->owned;
+    p->owned          = mutex;
+}
+#ifdef USE_PRIORITY_INHERITANCE
+//////////////////////////////////////////////////////////////////////
+// run the owner at the level of the highest task waiting on any of
+// the mutexes it holds, or its own level if that is higher.
+//////////////////////////////////////////////////////////////////////
+static void mutex_inherit( stack_frame_t *p ) {
+    uint8_t level = p->base_priority;
+    for ( task_mutex_t *m = p->owned; m != NULL; m = m->owned_next ) {
+        for ( stack_frame_t *w = m->head; w != NULL; w = w->wait_next ) {
+            if ( w->priority > level ) level = w->priority;
         }
-        prev = p;
-        if ( p->next == os.root_frame ) break;
     }
-    return NULL;
+    ready_level( p, level );
 }
+#endif
 //////////////////////////////////////////////////////////////////////
-// remove task from the run list
+// take the mutex off its owner, ownership goes directly to the first
+// waiter and it runs next in its level.
 //////////////////////////////////////////////////////////////////////
-stack_frame_t *add_task_to_runlist( task_func_t func ) {
-    stack_frame_t *p = NULL, *prev = NULL, *ret = NULL;
-    mem_block_t *start = os.mem.allocList( );
-    mem_block_t *end = start + 31;
-    do {
-        if ( start->block != 0 ) {
-            p = ( stack_frame_t * )start->block;
-            if ( p->ptr == func ) {
-                if ( p != os.root_frame ) prev->next = p;
-                p->next = os.root_frame;
-                prev = p;
-                ret = p;
-            } else if ( p->state == TaskCreated || p->state == TaskDestroyable ) {
-                if ( p != os.root_frame ) prev->next = p;
-                p->next = os.root_frame;
-                prev = p;
+static void mutex_release( task_mutex_t *mutex ) {
+    stack_frame_t *p = mutex->owner;
+    task_mutex_t **link = &p->owned;
+    while ( *link != mutex ) link = &( *link )->owned_next;
+    *link = mutex->owned_next;
+    mutex->owned_next = NULL;
+    mutex->owner = NULL;
+    stack_frame_t *next = mutex->head;
+    if ( next != NULL ) {
+        mutex->head = next->wait_next;
+        if ( mutex->head == NULL ) mutex->tail = NULL;
+        next->wait_on = NULL;
+        mutex_own( mutex, next );
+    }
+#ifdef USE_PRIORITY_INHERITANCE
+    mutex_inherit( p );
+    // new owner inherits from whoever still waits behind it
+    if ( next != NULL ) mutex_inherit( next );
+#endif
+    if ( next != NULL ) ready_push( next );
+}
+//////////////////////////////////////////////////////////////////////
+// take the mutex or wait for it off the run list, the kernal and code
+// running before begin can't leave the run list so they spin instead.
+//////////////////////////////////////////////////////////////////////
+void task_mutex_lock( task_mutex_t *mutex ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    if ( mutex->owner == NULL ) {
+        mutex_own( mutex, p );
+        return;
+    }
+    if ( !os.begin || p == os.root_frame ) {
+        while ( mutex->owner != NULL ) yield( );
+        mutex_own( mutex, p );
+        return;
+    }
+    // unlock makes us the owner. A task paused while queued was taken
+    // off the queue, once resumed it takes a free mutex or queues again.
+    while ( mutex->owner != p ) {
+        if ( mutex->owner == NULL ) {
+            mutex_own( mutex, p );
+            return;
+        }
+        if ( p->wait_on != mutex ) {
+            p->wait_on   = mutex;
+            p->wait_kind = WaitMutex;
+            p->wait_next = NULL;
+            if ( mutex->tail == NULL ) mutex->head = p;
+            else mutex->tail->wait_next = p;
+            mutex->tail = p;
+#ifdef USE_PRIORITY_INHERITANCE
+            if ( p->priority > mutex->owner->priority ) ready_level( mutex->owner, p->priority );
+#endif
+        }
+        ready_remove( p );
+        yield( );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// release the mutex, ownership goes directly to the first waiter
+// and it runs next in its level.
+//////////////////////////////////////////////////////////////////////
+void task_mutex_unlock( task_mutex_t *mutex ) {
+    stack_frame_t *p = mutex->owner;
+    if ( p == NULL || p != ( stack_frame_t * )os.current_frame ) return;
+    mutex_release( mutex );
+}
+//////////////////////////////////////////////////////////////////////
+// take the mutex only if it is free, returns 1 on success
+//////////////////////////////////////////////////////////////////////
+uint32_t task_mutex_trylock( task_mutex_t *mutex ) {
+    if ( mutex->owner != NULL ) return 0;
+    mutex_own( mutex, ( stack_frame_t * )os.current_frame );
+    return 1;
+}
+//////////////////////////////////////////////////////////////////////
+// ISRs only count and post, waiters are moved to the run list here in
+// task context so the run lists never need interrupts masked.
+//////////////////////////////////////////////////////////////////////
+void task_posted( void ) {
+    for ( ;; ) {
+        // detach one node at a time, an ISR can post again as soon as
+        // posted is cleared and that relinks post_next
+        uint32_t primask = irq_save( );
+        task_sem_t *sem = os.sem_posted;
+        if ( sem != NULL ) {
+            os.sem_posted = sem->post_next;
+            sem->post_next = NULL;
+            sem->posted = false;
+        }
+        irq_restore( primask );
+        if ( sem == NULL ) break;
+        
+        // wake one waiter per count, they take it when they run
+        stack_frame_t *woke = NULL;
+        uint32_t count = sem->count;
+        while ( count-- > 0 && sem->head != NULL ) {
+            stack_frame_t *p = sem->head;
+            sem->head = p->wait_next;
+            p->wait_on   = NULL;
+            p->wait_next = woke;
+            woke = p;
+        }
+        if ( sem->head == NULL ) sem->tail = NULL;
+        wait_push( woke );
+    }
+    for ( ;; ) {
+        uint32_t primask = irq_save( );
+        task_event_t *event = os.event_posted;
+        if ( event != NULL ) {
+            os.event_posted = event->post_next;
+            event->post_next = NULL;
+            event->posted = false;
+        }
+        irq_restore( primask );
+        if ( event == NULL ) break;
+        
+        stack_frame_t *woke = NULL;
+        stack_frame_t **link = &event->head;
+        stack_frame_t *last = NULL;
+        uint32_t flags = event->flags;
+        while ( *link != NULL ) {
+            stack_frame_t *p = *link;
+            uint32_t match = flags & p->wait_flags;
+            if ( p->wait_all ? match == p->wait_flags : match != 0 ) {
+                *link = p->wait_next;
+                p->wait_on   = NULL;
+                p->wait_next = woke;
+                woke = p;
+            } else {
+                last = p;
+                link = &p->wait_next;
             }
         }
-    } while ( ++start != end );
-    return ret;
+        event->tail = last;
+        wait_push( woke );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// push woken waiters to the front of their levels, the list is in
+// reverse so they end up running in the order they waited.
+//////////////////////////////////////////////////////////////////////
+void wait_push( stack_frame_t *woke ) {
+    while ( woke != NULL ) {
+        stack_frame_t *p = woke->wait_next;
+        ready_push( woke );
+        woke = p;
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// take a paused or restarted task off the queue it waits in
+//////////////////////////////////////////////////////////////////////
+void wait_cancel( stack_frame_t *p ) {
+    void *on = p->wait_on;
+    stack_frame_t **link = NULL;
+    stack_frame_t **tail = NULL;
+    if ( on != NULL ) {
+        switch ( p->wait_kind ) {
+            case WaitMutex:
+                link = &( ( task_mutex_t * )on )->head;
+                tail = &( ( task_mutex_t * )on )->tail;
+                break;
+            case WaitSemaphore:
+                link = &( ( task_sem_t * )on )->head;
+                tail = &( ( task_sem_t * )on )->tail;
+                break;
+            case WaitEvent:
+                link = &( ( task_event_t * )on )->head;
+                tail = &( ( task_event_t * )on )->tail;
+                break;
+            case WaitJoin:
+                link = &( ( stack_frame_t * )on )->joiners;
+                break;
+        }
+    }
+    if ( link != NULL ) {
+        // masked, give and setFlags look at the heads from an ISR
+        uint32_t primask = irq_save( );
+        stack_frame_t *last = NULL;
+        while ( *link != NULL && *link != p ) {
+            last = *link;
+            link = &last->wait_next;
+        }
+        if ( *link == p ) {
+            *link = p->wait_next;
+            if ( tail != NULL && *tail == p ) *tail = last;
+        }
+        irq_restore( primask );
+    }
+    p->wait_on   = NULL;
+    p->wait_next = NULL;
+#ifdef USE_PRIORITY_INHERITANCE
+    // the owner may have been running at our level
+    if ( on != NULL && p->wait_kind == WaitMutex ) mutex_inherit( ( ( task_mutex_t * )on )->owner );
+#endif
+}
+//////////////////////////////////////////////////////////////////////
+// a restarted or destroyed task never unlocks, hand the mutexes it
+// holds to their next waiters.
+//////////////////////////////////////////////////////////////////////
+void mutex_release_all( stack_frame_t *p ) {
+    while ( p->owned != NULL ) mutex_release( p->owned );
+}
+//////////////////////////////////////////////////////////////////////
+// count one give and post the semaphore for the next yield, ISR safe
+//////////////////////////////////////////////////////////////////////
+void task_sem_give( task_sem_t *sem ) {
+    uint32_t primask = irq_save( );
+    sem->count++;
+    if ( sem->head != NULL && !sem->posted ) {
+        sem->posted    = true;
+        sem->post_next = os.sem_posted;
+        os.sem_posted  = sem;
+    }
+    irq_restore( primask );
+}
+//////////////////////////////////////////////////////////////////////
+// take one count, waiting off the run list while there is none
+//////////////////////////////////////////////////////////////////////
+void task_sem_take( task_sem_t *sem ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    while ( 1 ) {
+        uint32_t primask = irq_save( );
+        if ( sem->count > 0 ) {
+            sem->count--;
+            irq_restore( primask );
+            return;
+        }
+        if ( !os.begin || p == os.root_frame ) {
+            irq_restore( primask );
+            yield( );
+            continue;
+        }
+        // queued with interrupts masked so a give can't slip in between,
+        // a task resumed early is still queued and just parks again.
+        if ( p->wait_on == NULL ) {
+            p->wait_on   = sem;
+            p->wait_kind = WaitSemaphore;
+            p->wait_next = NULL;
+            if ( sem->tail == NULL ) sem->head = p;
+            else sem->tail->wait_next = p;
+            sem->tail = p;
+        }
+        irq_restore( primask );
+        ready_remove( p );
+        yield( );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// take one count if there is one, returns 1 on success
+//////////////////////////////////////////////////////////////////////
+uint32_t task_sem_trytake( task_sem_t *sem ) {
+    uint32_t primask = irq_save( );
+    uint32_t taken = sem->count > 0;
+    if ( taken ) sem->count--;
+    irq_restore( primask );
+    return taken;
+}
+//////////////////////////////////////////////////////////////////////
+// set flags and post the group for the next yield, ISR safe
+//////////////////////////////////////////////////////////////////////
+void task_event_set( task_event_t *event, uint32_t flags ) {
+    uint32_t primask = irq_save( );
+    event->flags |= flags;
+    if ( event->head != NULL && !event->posted ) {
+        event->posted    = true;
+        event->post_next = os.event_posted;
+        os.event_posted  = event;
+    }
+    irq_restore( primask );
+}
+
+void task_event_clear( task_event_t *event, uint32_t flags ) {
+    uint32_t primask = irq_save( );
+    event->flags &= ~flags;
+    irq_restore( primask );
+}
+//////////////////////////////////////////////////////////////////////
+// wait for any or all of 'flags', returns the ones that were set
+//////////////////////////////////////////////////////////////////////
+uint32_t task_event_wait( task_event_t *event, uint32_t flags, uint32_t all, uint32_t clear ) {
+    stack_frame_t *p = ( stack_frame_t * )os.current_frame;
+    while ( 1 ) {
+        uint32_t primask = irq_save( );
+        uint32_t match = event->flags & flags;
+        if ( all ? match == flags : match != 0 ) {
+            if ( clear ) event->flags &= ~match;
+            irq_restore( primask );
+            return match;
+        }
+        if ( !os.begin || p == os.root_frame ) {
+            irq_restore( primask );
+            yield( );
+            continue;
+        }
+        // queued with interrupts masked so a set can't slip in between
+        p->wait_flags = flags;
+        p->wait_all   = all;
+        if ( p->wait_on == NULL ) {
+            p->wait_on   = event;
+            p->wait_kind = WaitEvent;
+            p->wait_next = NULL;
+            if ( event->tail == NULL ) event->head = p;
+            else event->tail->wait_next = p;
+            event->tail = p;
+        }
+        irq_restore( primask );
+        ready_remove( p );
+        yield( );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// allocate a queue's slots and done flags from the memory pool,
+// returns 0 if the pool is out of room.
+//////////////////////////////////////////////////////////////////////
+uint32_t task_queue_create( task_queue_t *queue, uint32_t slot_size, uint32_t capacity ) {
+    if ( capacity == 0 || capacity > 0xFFFF ) return 0;
+    slot_size = ( slot_size + sizeof( uintptr_t ) - 1 ) & ~( sizeof( uintptr_t ) - 1 );
+    uint32_t nwords = ( slot_size * capacity + capacity + 3 ) >> 2;
+    // alloc's length includes the tag words in front of the block
+    mem_block_t *block = os.mem.alloc( nwords + MEM_TAG_WORDS );
+    if ( block == NULL ) return 0;
+    *queue = { 0 };
+    queue->buffer      = ( uint8_t * )block->block;
+    queue->done        = queue->buffer + slot_size * capacity;
+    queue->slot_size   = slot_size;
+    queue->capacity    = capacity;
+    queue->slots.count = capacity;
+    memset( queue->done, 0, capacity );
+    return 1;
+}
+
+void task_queue_destroy( task_queue_t *queue ) {
+    if ( queue->buffer == NULL ) return;
+    os.mem.free( ( uint32_t * )queue->buffer );
+    queue->buffer = NULL;
+}
+//////////////////////////////////////////////////////////////////////
+// next writable slot, waits while the queue is full unless told not
+// to, then it returns NULL.
+//////////////////////////////////////////////////////////////////////
+void *task_queue_reserve( task_queue_t *queue, uint32_t wait ) {
+    if ( wait ) task_sem_take( &queue->slots );
+    else if ( !task_sem_trytake( &queue->slots ) ) return NULL;
+    uint8_t *slot = queue->buffer + queue->reserve_index * queue->slot_size;
+    if ( ++queue->reserve_index == queue->capacity ) queue->reserve_index = 0;
+    return slot;
+}
+//////////////////////////////////////////////////////////////////////
+// hand a filled slot to the consumers, slots committed out of order
+// wait for the ones reserved before them.
+//////////////////////////////////////////////////////////////////////
+void task_queue_commit( task_queue_t *queue, void *slot ) {
+    uint32_t index = ( ( uint8_t * )slot - queue->buffer ) / queue->slot_size;
+    queue->done[index] = true;
+    while ( queue->done[queue->commit_index] ) {
+        queue->done[queue->commit_index] = false;
+        if ( ++queue->commit_index == queue->capacity ) queue->commit_index = 0;
+        task_sem_give( &queue->items );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// oldest readable slot, waits while the queue is empty unless told
+// not to, then it returns NULL.
+//////////////////////////////////////////////////////////////////////
+void *task_queue_receive( task_queue_t *queue, uint32_t wait ) {
+    if ( wait ) task_sem_take( &queue->items );
+    else if ( !task_sem_trytake( &queue->items ) ) return NULL;
+    uint8_t *slot = queue->buffer + queue->receive_index * queue->slot_size;
+    if ( ++queue->receive_index == queue->capacity ) queue->receive_index = 0;
+    return slot;
+}
+//////////////////////////////////////////////////////////////////////
+// hand a read slot back to the producers, same ordering as commit
+//////////////////////////////////////////////////////////////////////
+void task_queue_release( task_queue_t *queue, void *slot ) {
+    uint32_t index = ( ( uint8_t * )slot - queue->buffer ) / queue->slot_size;
+    queue->done[index] = true;
+    while ( queue->done[queue->release_index] ) {
+        queue->done[queue->release_index] = false;
+        if ( ++queue->release_index == queue->capacity ) queue->release_index = 0;
+        task_sem_give( &queue->slots );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// Pool worker, takes the oldest job, frees its slot for the next
+// submit and runs it. The last job to finish sets the idle flag.
+//////////////////////////////////////////////////////////////////////
+void task_pool_worker( void *arg ) {
+    task_pool_t *pool = ( task_pool_t * )arg;
+    while ( 1 ) {
+        task_job_t *slot = ( task_job_t * )task_queue_receive( &pool->jobs, true );
+        task_job_t job = *slot;
+        task_queue_release( &pool->jobs, slot );
+        job.func( job.arg );
+        if ( job.done != NULL ) task_sem_give( job.done );
+        if ( --pool->pending == 0 ) task_event_set( &pool->idle, 1 );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// queue one job, waits while the queue is full unless told not to,
+// then it returns 0.
+//////////////////////////////////////////////////////////////////////
+uint32_t task_pool_submit( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done, uint32_t wait ) {
+    task_job_t *slot = ( task_job_t * )task_queue_reserve( &pool->jobs, wait );
+    if ( slot == NULL ) return 0;
+    slot->func = func;
+    slot->arg  = arg;
+    slot->done = done;
+    pool->pending++;
+    task_queue_commit( &pool->jobs, slot );
+    return 1;
+}
+//////////////////////////////////////////////////////////////////////
+// queue func(args[i]) for each arg, all of them count as pending
+// before the first is queued so a wait can't see the pool idle in
+// the middle of a batch.
+//////////////////////////////////////////////////////////////////////
+void task_pool_batch( task_pool_t *pool, task_func_t func, void **args, uint32_t n, task_sem_t *done ) {
+    pool->pending += n;
+    for ( uint32_t i = 0; i < n; i++ ) {
+        task_job_t *slot = ( task_job_t * )task_queue_reserve( &pool->jobs, true );
+        slot->func = func;
+        slot->arg  = args[i];
+        slot->done = done;
+        task_queue_commit( &pool->jobs, slot );
+    }
+}
+//////////////////////////////////////////////////////////////////////
+// wait off the run list till every submitted job has finished, an
+// idle flag left from an earlier batch is cleared by the wait.
+//////////////////////////////////////////////////////////////////////
+void task_pool_wait( task_pool_t *pool ) {
+    while ( pool->pending != 0 ) task_event_wait( &pool->idle, 1, false, true );
 }
@@ -29,30 +29,229 @@
 #ifdef __cplusplus
 #include "utility/task.h"
 #include "utility/mem_manager.h"
+#include "utility/task_ring.h"
 /**************************************************
  * This allows yield calls in a ISR not to lockup,
  * the kernel. Uncomment if any ISR calls yield in
  * its handler code.
  **************************************************/
 //#define USE_INTERRUPTS
+/**************************************************
+ * Turns delay calls in the sketch into Zilch::sleep
+ * so a delaying task is parked instead of spinning
+ * on yield. Only code that includes zilch.h after
+ * this is affected, not the Teensyduino core.
+ **************************************************/
+//#define USE_SLEEPING_DELAY
+/**************************************************
+ * A task blocked on a mutex lends its priority to
+ * the owner until it unlocks. Uncomment to enable.
+ **************************************************/
+//#define USE_PRIORITY_INHERITANCE
+/**************************************************
+ * Teensy 3.5/3.6 only, the system MPU blocks the
+ * bottom 32 bytes of the running task's stack so
+ * an overflow faults right away. Create tasks with
+ * watermark false to skip the kernal's scan too.
+ **************************************************/
+//#define USE_STACK_GUARD
+/**************************************************
+ * yield keeps per task run time, switch count and
+ * longest run between yields, read them with
+ * Zilch::stats. Costs a few cycles per yield.
+ **************************************************/
+//#define USE_TASK_STATS
+/**************************************************
+ * Record every switch, start, return, pause and
+ * resume in a RAM ring of TRACE_RECORDS entries
+ * (8 bytes each, power of two), dump it with
+ * Zilch::traceDump and decode it with
+ * extras/trace/zilch_trace.py.
+ **************************************************/
+//#define USE_TRACE
+/**************************************************
+ * When every task is sleeping or blocked the kernal
+ * waits for the next interrupt with WFI instead of
+ * spinning on yield, read how long with
+ * Zilch::idleStats. The 1ms SysTick keeps running
+ * so millis and micros stay right.
+ **************************************************/
+//#define USE_IDLE_SLEEP
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 256
+#endif
+static_assert( TRACE_RECORDS <= 0xFFFF, "traceDump's header holds a 16 bit record count" );
+/**************************************************
+ * Stack of the task that runs every software timer
+ * callback, created by the first timerStart. Add it
+ * to AllocateMemoryPool when using timers.
+ **************************************************/
+#ifndef TIMER_STACK_SIZE
+#define TIMER_STACK_SIZE 256
+#endif
+/**************************************************
+ * Deferred work items an ISR can queue for the timer
+ * task before it runs, power of two. 8 bytes each.
+ **************************************************/
+#ifndef DEFER_QUEUE_SIZE
+#define DEFER_QUEUE_SIZE 16
+#endif
+/**************************************************
+ * Number of task priority levels, 1 to 32. Level 0
+ * is the lowest and where every task and the kernal
+ * start out.
+ **************************************************/
+#ifndef TASK_PRIORITY_LEVELS
+#define TASK_PRIORITY_LEVELS 8
+#endif
 
 class Zilch {
 private:
+    bool      timerTask         ( void );
 public:
     Zilch                       ( uint32_t override_pattern = 0xCDCDCDCD ) ;
-    TaskState create            ( task_func_t task, size_t stack_size, void *arg );
-    TaskState createDestroyable ( task_func_t task, size_t stack_size, void *arg );
+    // watermark false skips filling the stack, the kernal won't
+    // check it for overflow
+    task_handle_t create            ( task_func_t task, size_t stack_size, void *arg, bool watermark = true );
+    task_handle_t createDestroyable ( task_func_t task, size_t stack_size, void *arg, bool watermark = true );
+    // destroyable task whose return value goes to 'future', if it can't
+    // be created the future is ready at once with NULL
+    task_handle_t createFuture      ( task_result_func_t task, size_t stack_size, void *arg, task_future_t *future, bool watermark = true );
     void      begin             ( void );
+    // does nothing, kept for old sketches, see join
     void      sync              ( void );
+    // park the calling task until 'task' returns, it uses no switches
+    // while it waits. TaskInvalid if the handle was already stale.
+    TaskState join              ( task_handle_t task );
+    // park until the future's task has returned and get its value,
+    // NULL if the task was paused and destroyed before it returned
+    void     *futureWait        ( task_future_t *future );
+    bool      futureReady       ( task_future_t *future );
     void      restartAll        ( void );
+    TaskState pause             ( task_handle_t task );
+    TaskState resume            ( task_handle_t task );
+    TaskState restart           ( task_handle_t task );
+    TaskState state             ( task_handle_t task );
+    uint32_t  freeMemory        ( task_handle_t task );
+    TaskState priority          ( task_handle_t task, uint8_t level );
+    // copy of the task's run time stats, zeros without USE_TASK_STATS
+    TaskState stats             ( task_handle_t task, task_stats_t *stats );
+    void      resetStats        ( void );
+    // write the trace ring to Serial in binary, oldest record first
+    void      traceDump         ( void );
+    void      traceClear        ( void );
+    // time spent idle since begin or resetIdleStats, zeros without USE_IDLE_SLEEP
+    void      idleStats         ( task_idle_t *idle );
+    void      resetIdleStats    ( void );
+    // function lookups, act on the first task found running 'task'
     TaskState pause             ( task_func_t task );
     TaskState resume            ( task_func_t task );
     TaskState restart           ( task_func_t task );
     TaskState stop              ( task_func_t task );
     TaskState state             ( task_func_t task );
     uint32_t  freeMemory        ( task_func_t task );
+    // blocking mutex, waiters are served in FIFO order
+    void      lock              ( task_mutex_t *mutex );
+    void      unlock            ( task_mutex_t *mutex );
+    bool      tryLock           ( task_mutex_t *mutex );
+    // counting semaphore, give may be called from an ISR
+    void      give              ( task_sem_t *sem );
+    void      take              ( task_sem_t *sem );
+    bool      tryTake           ( task_sem_t *sem );
+    // event flags, setFlags may be called from an ISR. waitFlags
+    // returns the flags it woke on and clears them unless told not to.
+    void      setFlags          ( task_event_t *event, uint32_t flags );
+    void      clearFlags        ( task_event_t *event, uint32_t flags );
+    uint32_t  waitFlags         ( task_event_t *event, uint32_t flags, bool all = false, bool clear = true );
+    // park the calling task off the run list until the time is up,
+    // only a resume wakes it earlier
+    static void sleep             ( uint32_t ms );
+    static void sleepMicroseconds ( uint32_t us );
+    // software timers, func runs from one timer task on the top priority
+    // level once or every 'ms' until stopped, up to 35 minutes. Start
+    // returns false when the pool has no room for the timer task.
+    bool      timerStart        ( task_timer_t *timer, task_func_t func, void *arg, uint32_t ms, bool reload = false );
+    void      timerStop         ( task_timer_t *timer );
+    void      timerPeriod       ( task_timer_t *timer, uint32_t ms );
+    bool      timerActive       ( task_timer_t *timer );
+    // deferred work, an ISR hands func(arg) to the timer task which runs
+    // it ahead of any timer. defer is ISR safe and returns false when the
+    // queue is full, deferBegin creates the timer task if need be.
+    bool      deferBegin        ( void );
+    bool      defer             ( task_func_t func, void *arg );
+    uint32_t  deferDropped      ( void );
+    // worker pool, 'workers' tasks of 'stack_size' words run submitted
+    // func(arg) jobs from a queue of 'capacity', in the order submitted.
+    // submit waits while the queue is full, 'done' is given when the job
+    // finishes. poolWait waits until every submitted job has finished,
+    // don't call it from a job.
+    bool      poolBegin         ( task_pool_t *pool, uint8_t workers, size_t stack_size, uint16_t capacity );
+    void      submit            ( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done = NULL );
+    bool      trySubmit         ( task_pool_t *pool, task_func_t func, void *arg, task_sem_t *done = NULL );
+    void      submitBatch       ( task_pool_t *pool, task_func_t func, void **args, uint16_t n, task_sem_t *done = NULL );
+    void      poolWait          ( task_pool_t *pool );
+    uint32_t  poolPending       ( task_pool_t *pool );
+    // a task whose untouched stack shrinks to waterMark words is paused
+    // and handed to the callback, which runs from the kernal task
     void      lowMemoryWaterMark( uint16_t waterMark );
+    void      lowMemoryCallback ( task_memory_func_t callback );
+    uint32_t  unusedStack       ( task_handle_t task );
+    // memory pool in words, fragmentation is the percent of free
+    // memory that is not in the largest free block
+    uint32_t  freePoolMemory    ( void );
+    uint32_t  largestFreeBlock  ( void );
+    uint8_t   fragmentation     ( void );
     void      printMemoryHeader ( void );
 };
+//////////////////////////////////////////////////////////////////////
+// Queue memory in words, word rounded slots, a done byte per slot and
+// the block's tag words with the alloc rounding.
+//////////////////////////////////////////////////////////////////////
+#define QUEUE_MEMORY( slot_size, capacity ) \
+    ( ( ( ( ( slot_size ) + sizeof( uintptr_t ) - 1 ) & ~( sizeof( uintptr_t ) - 1 ) ) * ( capacity ) + ( capacity ) + 3 ) / 4 + 2 * MEM_TAG_WORDS )
+//////////////////////////////////////////////////////////////////////
+// Worker pool memory in words, add it to AllocateMemoryPool
+//////////////////////////////////////////////////////////////////////
+#define POOL_MEMORY( workers, stack_size, capacity ) \
+    ( ( workers ) * ( stack_size ) + QUEUE_MEMORY( sizeof( task_job_t ), capacity ) )
+//////////////////////////////////////////////////////////////////////
+// Typed message queue, T is copied as plain data. Slots come from the
+// memory pool so add 'QUEUE_MEMORY( sizeof(T), capacity )' words to
+// AllocateMemoryPool for each queue.
+//////////////////////////////////////////////////////////////////////
+template <typename T> class TaskQueue {
+public:
+    TaskQueue                   ( void ) { queue.buffer = NULL; }
+    // allocate 'capacity' slots, false if the pool is out of room
+    bool      begin             ( uint16_t capacity ) { return task_queue_create( &queue, sizeof( T ), capacity ); }
+    void      end               ( void ) { task_queue_destroy( &queue ); }
+    // zero copy, fill a reserved slot in place then commit it
+    T        *reserve           ( void ) { return ( T * )task_queue_reserve( &queue, true ); }
+    T        *tryReserve        ( void ) { return ( T * )task_queue_reserve( &queue, false ); }
+    void      commit            ( T *slot ) { task_queue_commit( &queue, slot ); }
+    // zero copy, read a received slot in place then release it
+    T        *receive           ( void ) { return ( T * )task_queue_receive( &queue, true ); }
+    T        *tryReceive        ( void ) { return ( T * )task_queue_receive( &queue, false ); }
+    void      release           ( T *slot ) { task_queue_release( &queue, slot ); }
+    // copying versions of the above
+    void      send              ( const T &msg ) {
+        T *slot = reserve( );
+        *slot = msg;
+        commit( slot );
+    }
+    void      receive           ( T &msg ) {
+        T *slot = receive( );
+        msg = *slot;
+        release( slot );
+    }
+    uint32_t  available         ( void ) { return queue.items.count; }
+    uint32_t  capacity          ( void ) { return queue.capacity; }
+private:
+    task_queue_t queue;
+};
+
+#ifdef USE_SLEEPING_DELAY
+#define delay( msec ) Zilch::sleep( msec )
+#endif
 #endif
 #endif